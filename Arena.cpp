@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include <QtGlobal>
+
+thread_local Arena g_arena;
+
+void AlignedBuffer::resize(Eigen::Index size)
+{
+    m_storage.assign(size_t(size + cacheLineFloats), 0.f);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(m_storage.data());
+    const uintptr_t line = sizeof(float) * uintptr_t(cacheLineFloats);
+    m_data = m_storage.data() + (line - address % line) % line / sizeof(float);
+    m_size = size;
+}
+
+Eigen::Map<ArrayXX> Arena::allocate(Eigen::Index rows, Eigen::Index cols)
+{
+    const Eigen::Index size = std::max(cacheLineFloats, padded(rows * cols));
+
+    while (m_block < m_blocks.size() && m_used + size > m_blocks[m_block].size()) {
+        ++m_block;
+        m_used = 0;
+    }
+    if (m_block == m_blocks.size()) {
+        const Eigen::Index lastSize = m_blocks.empty() ? 0 : m_blocks.back().size();
+        m_blocks.emplace_back(std::max(size, 2 * lastSize));
+    }
+    float* data = m_blocks[m_block].data() + m_used;
+    m_used += size;
+    return Eigen::Map<ArrayXX>(data, rows, cols);
+}
+
+void Arena::release(const Mark& mark)
+{
+    Q_ASSERT(mark.block < m_block || (mark.block == m_block && mark.used <= m_used));
+    m_block = mark.block;
+    m_used = mark.used;
+}
+
+void Arena::reset()
+{
+    m_block = 0;
+    m_used = 0;
+    if (m_blocks.size() > 1) {
+        const Eigen::Index size = capacity();
+        m_blocks.clear();
+        m_blocks.emplace_back(size);
+    }
+}
+
+Eigen::Index Arena::capacity() const
+{
+    Eigen::Index size = 0;
+    for (const auto& block : m_blocks)
+        size += block.size();
+    return size;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+
+#include "Eigen/Core"
+
+using ArrayXX = Eigen::ArrayXXf;
+
+// floats per cache line. buffers of the arena and of Plan's workspace start on a cache line of their own,
+// so that threads working on neighbouring buffers don't share a line.
+const Eigen::Index cacheLineFloats = 16;
+
+inline Eigen::Index padded(Eigen::Index size)
+{
+    return (size + cacheLineFloats - 1) / cacheLineFloats * cacheLineFloats;
+}
+
+// float storage whose first element starts a cache line. movable, not copyable.
+class AlignedBuffer {
+public:
+    explicit AlignedBuffer(Eigen::Index size = 0) { resize(size); }
+    AlignedBuffer(AlignedBuffer&&) = default;
+    AlignedBuffer& operator=(AlignedBuffer&&) = default;
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    // the content is not preserved
+    void resize(Eigen::Index size);
+    float* data() { return m_data; }
+    const float* data() const { return m_data; }
+    Eigen::Index size() const { return m_size; }
+
+private:
+    std::vector<float> m_storage;
+    float* m_data = nullptr;
+    Eigen::Index m_size = 0;
+};
+
+// bump allocator for short lived temporaries. memory is handed out as maps into large blocks,
+// Scope rewinds to the state at its construction. reset() rewinds completely and merges all blocks
+// into one, so that after the first iteration no further blocks are needed.
+class Arena {
+public:
+    struct Mark {
+        size_t block;
+        Eigen::Index used;
+    };
+    class Scope {
+        Arena& m_arena;
+        Mark m_mark;
+    public:
+        explicit Scope(Arena& arena) : m_arena(arena), m_mark(arena.mark()) {}
+        Scope(const Scope&) = delete;
+        ~Scope() { m_arena.release(m_mark); }
+    };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Eigen::Map<ArrayXX> allocate(Eigen::Index rows, Eigen::Index cols);
+    Mark mark() const { return {m_block, m_used}; }
+    void release(const Mark& mark);
+    void reset();
+    // in floats
+    Eigen::Index capacity() const;
+    size_t nBlocks() const { return m_blocks.size(); }
+
+private:
+    std::vector<AlignedBuffer> m_blocks;
+    size_t m_block = 0;
+    Eigen::Index m_used = 0;
+};
+
+// one per thread
+extern thread_local Arena g_arena;
+
+#endif // ARENA_H
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Benchmarks.h"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "Expression.h"
+#include "operators.h"
+#include "Plan.h"
+
+namespace {
+template<typename Function>
+double nanosecondsPerCall(long calls, const Function& function)
+{
+    const auto begin = std::chrono::steady_clock::now();
+    for (long i = 0; i < calls; ++i)
+        function();
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / calls;
+}
+
+// per node overhead on tiny tensors: the opcode switch used by Plan against virtual calls, on the same
+// operators and 2x2 operands. then a whole plan over a chain of tiny nodes, per instruction.
+void benchmarkDispatch() {
+    std::cout << "benchmarkDispatch()" << std::endl;
+
+    const std::vector<operators::Ptr> ops = {&operators::g_add, &operators::g_mul, &operators::g_matMul, &operators::g_relu,
+                                             &operators::g_exp, &operators::g_subtract, &operators::g_div, &operators::g_log};
+    const ArrayXX a = ArrayXX::Random(2, 2) + 2.f;
+    const ArrayXX b = ArrayXX::Random(2, 2) + 2.f;
+    ArrayXX out(2, 2);
+    const long rounds = 200000;
+    const double switched = nanosecondsPerCall(rounds, [&]() {
+        for (auto op : ops)
+            operators::eval(op->opcode(), a, b, out);
+    }) / ops.size();
+    const double virtualCalls = nanosecondsPerCall(rounds, [&]() {
+        for (auto op : ops)
+            op->eval(a, b, out);
+    }) / ops.size();
+    std::cout << "eval, switch: " << switched << " ns, virtual: " << virtualCalls << " ns" << std::endl;
+
+    auto x = Variable::make(ArrayXX::Random(2, 1));
+    auto W = Variable::make(ArrayXX::Random(2, 2));
+    ExpressionPtr f = x;
+    for (int i = 0; i < 500; ++i)
+        f = relu(W * f);
+    auto plan = Plan::make(reduceSum(f));
+    const double perPlan = nanosecondsPerCall(1000, [&]() {
+        plan->forward();
+        plan->backward();
+    });
+    std::cout << "plan forward and backward: " << perPlan / plan->instructions().size() << " ns per instruction" << std::endl;
+}
+}
+
+void benchmark()
+{
+    benchmarkDispatch();
+}
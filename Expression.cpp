@@ -29,102 +29,403 @@
 
 #include "Expression.h"
 
+#include <algorithm>
 #include <iostream>
+#include <unordered_set>
 
 #include <QtGlobal>
 
+#include "Arena.h"
 #include "operators.h"
 
-Expression::Expression(std::shared_ptr<Expression> a, std::shared_ptr<Expression> b, operators::Ptr op) : m_a(a), m_b(b), m_op(op)
+Expression::Expression(std::vector<std::shared_ptr<Expression>> operands, operators::Ptr op)
+    : m_operands(std::move(operands)), m_op(op), m_operandVersions(m_operands.size(), 0)
 {
+    Q_ASSERT(!m_operands.empty());
+    Q_ASSERT(op->arity() == -1 || size_t(op->arity()) == m_operands.size());
 }
 
-ArrayXX Expression::evalForward()
+Expression::Expression(std::shared_ptr<Expression> a, std::shared_ptr<Expression> b, operators::Ptr op)
+    : Expression(std::vector<std::shared_ptr<Expression>>{std::move(a), std::move(b)}, op)
 {
-    if (!m_aOpbValid) {
-        m_aOpb = m_op->eval(m_a->evalForward(), m_b->evalForward());
-        m_aOpbValid = true;
-//		if (m_aOpb.isInf().any() || m_aOpb.isNaN().any()) {
-//			std::cout << "a=" << m_a->evalForward().transpose() << std::endl;
-//			std::cout << "b=" << m_b->evalForward().transpose() << std::endl;
-//		}
-        Q_ASSERT(!m_aOpb.isNaN().any());
-		Q_ASSERT(!m_aOpb.isInf().any());
+}
+
+Expression::Expression(std::shared_ptr<Expression> a, operators::Ptr op)
+    : Expression(std::vector<std::shared_ptr<Expression>>{std::move(a)}, op)
+{
+}
+
+const ArrayXX& Expression::evalForward()
+{
+    // children before parents, so that every node is visited once, no matter how many paths lead to it
+    const auto& tape = this->tape();
+    if (!m_checkpointing) {
+        for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+            if ((*it)->m_op)
+                (*it)->update();
+        }
+        return m_aOpb;
+    }
+
+    // values are dropped as soon as their last consumer is up to date
+    for (auto node : tape)
+        node->m_pendingUses = 0;
+    for (auto node : tape) {
+        for (const auto& operand : node->m_operands)
+            ++operand->m_pendingUses;
+    }
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        if (!node->m_op)
+            continue;
+        // a dropped value that is still up to date is only recomputed if a consumer needs it
+        if (node == this || node->stale())
+            node->update();
+        for (const auto& operand : node->m_operands) {
+            if (--operand->m_pendingUses == 0 && operand->releasable())
+                operand->release();
+        }
     }
     return m_aOpb;
 }
-void Expression::differentiateBackward(const ArrayXX& factors)
-{
-//    static bool debug1 = false;
-//    static bool debug2 = false;
-    auto diffWrtA = m_op->differentiateWrtA(m_a->evalForward(), m_b->evalForward());
-    Q_ASSERT(!diffWrtA.isNaN().any());
-    Q_ASSERT(!diffWrtA.isInf().any());
-    auto chainedA = m_op->chainA(factors, diffWrtA);
-    Q_ASSERT(!chainedA.isNaN().any());
-    Q_ASSERT(!chainedA.isInf().any());
-//    if (debug1) {
-//        std::cout << "factors = " << factors.transpose() << std::endl;
-//        std::cout << "diffWrtA = " << diffWrtA.transpose() << std::endl;
-//        std::cout << "chainedA = " << chainedA.transpose() << std::endl;
-//    }
-    m_a->differentiateBackward(chainedA);
-//    if (debug2) {
-//        std::cout << "factors = " << factors.transpose() << std::endl;
-//        std::cout << "diffWrtA = " << diffWrtA.transpose() << std::endl;
-//        std::cout << "chainedA = " << chainedA.transpose() << std::endl;
-//    }
-
-    auto diffWrtB = m_op->differentiateWrtB(m_a->evalForward(), m_b->evalForward());
-    Q_ASSERT(!diffWrtB.isNaN().any());
-    Q_ASSERT(!diffWrtB.isInf().any());
-    auto chainedB = m_op->chainB(factors, diffWrtB);
-    Q_ASSERT(!chainedB.isNaN().any());
-    Q_ASSERT(!chainedB.isInf().any());
-//    if (debug1) {
-//        std::cout << "factors = " << factors.transpose() << std::endl;
-//        std::cout << "diffWrtB = " << diffWrtB.transpose() << std::endl;
-//        std::cout << "chainedB = " << chainedB.transpose() << std::endl;
-//    }
-    m_b->differentiateBackward(chainedB);
-//    if (debug2) {
-//        std::cout << "factors = " << factors.transpose() << std::endl;
-//        std::cout << "diffWrtB = " << diffWrtB.transpose() << std::endl;
-//        std::cout << "chainedB = " << chainedB.transpose() << std::endl;
-//    }
+
+bool Expression::stale() const
+{
+    if (!m_aOpbValid)
+        return true;
+    for (size_t i = 0; i < m_operands.size(); ++i) {
+        if (m_operandVersions[i] != m_operands[i]->m_version)
+            return true;
+    }
+    return false;
+}
+
+void Expression::update()
+{
+    if (!stale()) {
+        rematerialise();
+        return;
+    }
+    for (const auto& operand : m_operands)
+        operand->rematerialise();
+    m_released = false;
+    m_aOpb.resize(rows(), cols());
+    m_op->evalN(operandValues(), m_aOpb);
+    m_aOpbValid = true;
+    for (size_t i = 0; i < m_operands.size(); ++i)
+        m_operandVersions[i] = m_operands[i]->m_version;
+    ++m_version;
+    Q_ASSERT(!m_aOpb.isNaN().any());
+    Q_ASSERT(!m_aOpb.isInf().any());
+}
+void Expression::differentiateBackward(const ConstArrayRef& factors)
+{
+    // adjoints are summed per node and every node is visited once after all of its consumers,
+    // so that shared subexpressions are not backpropagated once per path.
+    evalForward();
+    updateRequiresGradient();
+    const auto& tape = this->tape();
+    if (!m_requiresGradient)
+        return;
+    accumulateAdjoint(factors);
+    for (auto node : tape) {
+        if (!node->m_adjointValid)
+            continue;
+        if (node->m_op) {
+            node->rematerialise();
+            for (const auto& operand : node->m_operands)
+                operand->rematerialise();
+            node->backpropagate();
+        }
+        else {
+            node->differentiateBackward(node->m_adjoint);
+        }
+        node->m_adjointValid = false;
+        // all consumers are done, the value and the adjoint are not needed any more
+        if (m_checkpointing && node != this && node->releasable()) {
+            node->release();
+            node->m_adjoint = ArrayXX();
+        }
+    }
+    // recomputed values of branches without gradient
+    if (m_checkpointing) {
+        for (auto node : tape) {
+            if (node != this && node->releasable())
+                node->release();
+        }
+    }
+}
+
+void Expression::updateRequiresGradient()
+{
+    const auto& tape = this->tape();
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        if (!node->m_op)
+            continue;
+        node->m_requiresGradient = false;
+        for (const auto& operand : node->m_operands)
+            node->m_requiresGradient = node->m_requiresGradient || operand->m_requiresGradient;
+    }
+}
+
+Expression::Dual Expression::evalForwardWithTangent()
+{
+    // values are updated incrementally as in evalForward(), tangents are always propagated.
+    // with checkpointing, values are dropped again once their last consumer is done, tangents are kept
+    const auto& tape = this->tape();
+    if (m_checkpointing) {
+        for (auto node : tape)
+            node->m_pendingUses = 0;
+        for (auto node : tape) {
+            for (const auto& operand : node->m_operands)
+                ++operand->m_pendingUses;
+        }
+    }
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        if (!node->m_op)
+            continue;
+        node->m_hasTangent = false;
+        for (const auto& operand : node->m_operands)
+            node->m_hasTangent = node->m_hasTangent || operand->m_hasTangent;
+        if (!m_checkpointing || node == this || node->m_hasTangent || node->stale())
+            node->update();
+        if (node->m_hasTangent) {
+            for (const auto& operand : node->m_operands)
+                operand->rematerialise();
+
+            // an operand without tangent is held fixed
+            Arena::Scope scope(g_arena);
+            node->m_tangent.resize(node->rows(), node->cols());
+            node->m_op->jvpN(node->operandValues(), node->current(), node->operandTangents(), node->m_tangent);
+            Q_ASSERT(!node->m_tangent.isNaN().any());
+        }
+        if (!m_checkpointing)
+            continue;
+        for (const auto& operand : node->m_operands) {
+            if (--operand->m_pendingUses == 0 && operand->releasable())
+                operand->release();
+        }
+    }
+    if (!m_hasTangent)
+        m_tangent.setZero(rows(), cols());
+    return {current(), m_tangent};
+}
+
+void Expression::rematerialise()
+{
+    // recomputes the segment back to the nearest values that were kept, without counting as a change.
+    // operands before consumers, with a stack instead of recursion as segments can be long chains
+    if (!m_released)
+        return;
+    std::vector<std::pair<Expression*, bool>> stack = {{this, false}};
+    while (!stack.empty()) {
+        auto entry = stack.back();
+        stack.pop_back();
+        Expression* node = entry.first;
+        if (!node->m_released)
+            continue;
+        if (entry.second) {
+            node->m_aOpb.resize(node->rows(), node->cols());
+            node->m_op->evalN(node->operandValues(), node->m_aOpb);
+            node->m_released = false;
+            continue;
+        }
+        stack.emplace_back(node, true);
+        for (const auto& operand : node->m_operands)
+            stack.emplace_back(operand.get(), false);
+    }
+}
+
+void Expression::release()
+{
+    m_aOpb = ArrayXX();
+    m_released = true;
+}
+
+void Expression::backpropagate()
+{
+    Arena::Scope scope(g_arena);
+    // values are up to date, see differentiateBackward()
+    const operators::Operands& x = operandValues();
+    const auto& result = current();
+
+    // constants get nothing
+    for (size_t k = 0; k < m_operands.size(); ++k) {
+        Expression* operand = m_operands[k].get();
+        if (!operand->m_requiresGradient)
+            continue;
+        auto chained = operand->contribution();
+        m_op->vjpN(int(k), x, result, m_adjoint, chained);
+        operand->commitContribution(chained);
+    }
+}
+
+void Expression::accumulateAdjoint(const ConstArrayRef& adjoint)
+{
+    if (m_adjointValid) {
+        m_adjoint += adjoint;
+    }
+    else {
+        m_adjoint = adjoint;
+        m_adjointValid = true;
+    }
+}
+
+Eigen::Map<ArrayXX> Expression::contribution()
+{
+    // the first contribution is written straight into the adjoint, everything else goes through scratch memory
+    if (!m_adjointValid) {
+        m_adjoint.resize(rows(), cols());
+        return Eigen::Map<ArrayXX>(m_adjoint.data(), m_adjoint.rows(), m_adjoint.cols());
+    }
+    return g_arena.allocate(rows(), cols());
+}
+
+void Expression::commitContribution(const Eigen::Map<ArrayXX>& contribution)
+{
+    Q_ASSERT(!contribution.isNaN().any());
+    Q_ASSERT(!contribution.isInf().any());
+    if (m_adjointValid)
+        m_adjoint += contribution;
+    else
+        m_adjointValid = true;
+}
+
+const std::vector<Expression*>& Expression::tape()
+{
+    if (!m_tape.empty())
+        return m_tape;
+
+    // iterative post order dfs (children before parents), reversed afterwards
+    std::unordered_set<Expression*> visited;
+    std::vector<std::pair<Expression*, bool>> stack = {{this, false}};
+    while (!stack.empty()) {
+        auto entry = stack.back();
+        stack.pop_back();
+        Expression* node = entry.first;
+        if (entry.second) {
+            m_tape.push_back(node);
+            continue;
+        }
+        if (!visited.insert(node).second)
+            continue;
+        stack.emplace_back(node, true);
+        for (auto it = node->m_operands.rbegin(); it != node->m_operands.rend(); ++it)
+            stack.emplace_back(it->get(), false);
+    }
+    std::reverse(m_tape.begin(), m_tape.end());
+    return m_tape;
 }
 
 Size Expression::size()
 {
-    if (m_size(0) == -1)
-        m_size = m_op->outSize(m_a->size(), m_b->size());
+    if (m_size(0) == -1) {
+        std::vector<Size> sizes;
+        for (const auto& operand : m_operands)
+            sizes.push_back(operand->size());
+        m_size = m_op->outSizeN(sizes);
+    }
     return m_size;
 }
 
 void Expression::reset()
 {
-    m_aOpbValid = false;
-    if (m_a)
-        m_a->reset();
-    if (m_b)
-        m_b->reset();
+    for (auto node : tape())
+        node->m_aOpbValid = false;
 }
 
-ArrayXX Variable::evalForward()
+const ArrayXX& Variable::evalForward()
 {
     return m_value;
 }
 
+void Variable::setValue(const ConstArrayRef& value)
+{
+    if (m_value.rows() == value.rows() && m_value.cols() == value.cols() && (m_value == value).all())
+        return;
+    m_value = value;
+    markChanged();
+}
+
 void Variable::resetGradient()
 {
     m_gradient = ArrayXX::Constant(m_value.rows(), m_value.cols(), 0);
 }
 
-void Variable::differentiateBackward(const ArrayXX& factors)
+void Variable::differentiateBackward(const ConstArrayRef& factors)
 {
     m_gradient += factors;
 }
 
+std::vector<ArrayXX> hvp(const ExpressionPtr& f, const std::vector<VariablePtr>& params, const std::vector<ArrayXX>& v)
+{
+    Q_ASSERT(params.size() == v.size());
+    for (size_t i = 0; i < params.size(); ++i) {
+        params[i]->setTangent(v[i]);
+        params[i]->m_adjointTangent.setZero(params[i]->rows(), params[i]->cols());
+    }
+    f->evalForwardWithTangent();
+    f->updateRequiresGradient();
+
+    // reverse sweep as in differentiateBackward, every adjoint carries its tangent along
+    Q_ASSERT(f->size().prod() == 1);
+    const auto& tape = f->tape();
+    for (auto node : tape) {
+        node->m_adjoint.setZero(node->rows(), node->cols());
+        node->m_adjointTangent.setZero(node->rows(), node->cols());
+    }
+    f->m_adjoint.setOnes();
+    for (auto node : tape) {
+        if (!node->m_op || !node->m_requiresGradient)
+            continue;
+        node->rematerialise();
+        for (const auto& operand : node->m_operands)
+            operand->rematerialise();
+        Arena::Scope scope(g_arena);
+        // operands without tangent are held fixed
+        const operators::Operands& x = node->operandValues();
+        const operators::Operands& tangents = node->operandTangents();
+        Eigen::Map<ArrayXX> tangentResult = g_arena.allocate(node->rows(), node->cols());
+        if (node->m_hasTangent)
+            tangentResult = node->m_tangent;
+        else
+            tangentResult.setZero();
+        for (size_t k = 0; k < node->m_operands.size(); ++k) {
+            Expression* operand = node->m_operands[k].get();
+            if (!operand->m_requiresGradient)
+                continue;
+            auto chained = g_arena.allocate(operand->rows(), operand->cols());
+            auto chainedTangent = g_arena.allocate(operand->rows(), operand->cols());
+            node->m_op->vjpN(int(k), x, node->current(), node->m_adjoint, chained);
+            node->m_op->vjpTangentN(int(k), x, node->current(), node->m_adjoint, tangents, tangentResult, node->m_adjointTangent, chainedTangent);
+            operand->m_adjoint += chained;
+            operand->m_adjointTangent += chainedTangent;
+        }
+        // all consumers are done, see differentiateBackward()
+        if (f->m_checkpointing && node != f.get() && node->releasable()) {
+            node->release();
+            node->m_adjoint = ArrayXX();
+            node->m_adjointTangent = ArrayXX();
+        }
+    }
+
+    std::vector<ArrayXX> products;
+    for (const auto& param : params) {
+        products.push_back(std::move(param->m_adjointTangent));
+        param->m_adjointTangent = ArrayXX();
+        param->clearTangent();
+    }
+    for (auto node : tape) {
+        node->m_adjoint.resize(0, 0);
+        node->m_adjointTangent.resize(0, 0);
+        if (f->m_checkpointing && node != f.get() && node->releasable())
+            node->release();
+    }
+    return products;
+}
+
 ExpressionPtr operator +(const ExpressionPtr &a, const ExpressionPtr &b)
 {
     return std::make_shared<Expression>(a, b, &operators::g_add);
@@ -140,24 +441,53 @@ ExpressionPtr operator *(const ExpressionPtr &a, const ExpressionPtr &b)
     return std::make_shared<Expression>(a, b, &operators::g_matMul);
 }
 
+const operators::Operands& Expression::operandValues() const
+{
+    // reused, so that evaluations don't allocate
+    static thread_local operators::Operands values;
+    values.clear();
+    for (const auto& operand : m_operands) {
+        const ArrayXX& value = operand->current();
+        values.emplace_back(value.data(), value.rows(), value.cols());
+    }
+    return values;
+}
+
+const operators::Operands& Expression::operandTangents() const
+{
+    // zero for operands without tangent, allocated in the current arena scope
+    static thread_local operators::Operands tangents;
+    tangents.clear();
+    for (const auto& operand : m_operands) {
+        if (operand->m_hasTangent) {
+            tangents.emplace_back(operand->m_tangent.data(), operand->m_tangent.rows(), operand->m_tangent.cols());
+            continue;
+        }
+        auto zero = g_arena.allocate(operand->rows(), operand->cols());
+        zero.setZero();
+        tangents.emplace_back(zero.data(), zero.rows(), zero.cols());
+    }
+    return tangents;
+}
+
 ExpressionPtr log(const ExpressionPtr &a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_log);
+    return std::make_shared<Expression>(a, &operators::g_log);
 }
 
 ExpressionPtr exp(const ExpressionPtr& a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_exp);
+    return std::make_shared<Expression>(a, &operators::g_exp);
 }
 
 ExpressionPtr normExp(const ExpressionPtr& a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_normExp);
+    return std::make_shared<Expression>(a, &operators::g_normExp);
 }
 
 ExpressionPtr relu(const ExpressionPtr& a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_relu);
+    return std::make_shared<Expression>(a, &operators::g_relu);
 }
 
 ExpressionPtr vvt(const ExpressionPtr &a, const ExpressionPtr &b)
@@ -167,12 +497,12 @@ ExpressionPtr vvt(const ExpressionPtr &a, const ExpressionPtr &b)
 
 ExpressionPtr reduceSum(const ExpressionPtr &a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_reduceSum);
+    return std::make_shared<Expression>(a, &operators::g_reduceSum);
 }
 
 ExpressionPtr reduceProd(const ExpressionPtr &a)
 {
-    return std::make_shared<Expression>(a, Constant::make(0), &operators::g_reduceProd);
+    return std::make_shared<Expression>(a, &operators::g_reduceProd);
 }
 
 ExpressionPtr matmul(const ExpressionPtr &a, const ExpressionPtr &b)
@@ -193,3 +523,11 @@ ExpressionPtr cwisediv(const ExpressionPtr& a, const ExpressionPtr& b)
 {
     return std::make_shared<Expression>(a, b, &operators::g_div);
 }
+
+ExpressionPtr sum(const std::vector<ExpressionPtr>& terms)
+{
+    Q_ASSERT(!terms.empty());
+    if (terms.size() == 1)
+        return terms.front();
+    return std::make_shared<Expression>(terms, &operators::g_sum);
+}
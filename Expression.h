@@ -31,53 +31,139 @@
 #define EXPRESSION_H
 
 #include <memory>
+#include <vector>
 #include "Eigen/Core"
 
 using ArrayXX = Eigen::ArrayXXf;
+using ArrayRef = Eigen::Ref<ArrayXX>;
+using ConstArrayRef = Eigen::Ref<const ArrayXX>;
 using Size = Eigen::Vector2i;
 
 class Expression;
 using ExpressionPtr = std::shared_ptr<Expression>;
+class Variable;
 
 namespace operators {
 struct Base;
 using Ptr = Base*;
+using Operands = std::vector<Eigen::Map<const ArrayXX>>;
 }
 
 class Expression {
-    ExpressionPtr m_a;
-    ExpressionPtr m_b;
-    operators::Ptr m_op;
+    std::vector<ExpressionPtr> m_operands;
+    operators::Ptr m_op = nullptr;
     ArrayXX m_aOpb;
     bool m_aOpbValid = false;
     Size m_size = Size(-1, -1);
+    ArrayXX m_adjoint;
+    bool m_adjointValid = false;
+    std::vector<Expression*> m_tape;
+    // versions of the operands at the time m_aOpb was computed
+    std::vector<unsigned> m_operandVersions;
+    // checkpointing: m_aOpb is up to date, but was dropped to save memory
+    bool m_released = false;
+    bool m_checkpoint = false;
+    bool m_checkpointing = false;
+    int m_pendingUses = 0;
 public:
+    struct Dual {
+        const ArrayXX& value;
+        const ArrayXX& tangent;
+    };
+    Expression(std::vector<std::shared_ptr<Expression>> operands, operators::Ptr op);
     Expression(std::shared_ptr<Expression> a, std::shared_ptr<Expression> b, operators::Ptr op);
+    Expression(std::shared_ptr<Expression> a, operators::Ptr op);
     virtual ~Expression() = default;
-    virtual ArrayXX evalForward();
-    virtual void differentiateBackward(const ArrayXX& factors = ArrayXX::Constant(1, 1, 1));
+    // the reference stays valid until the next reset() and re-evaluation. only nodes that depend on
+    // a changed leaf are re-evaluated.
+    virtual const ArrayXX& evalForward();
+    virtual void differentiateBackward(const ConstArrayRef& factors = ArrayXX::Constant(1, 1, 1));
+    // forward mode: value and directional derivative along the tangents of the leaves, in one sweep.
+    // leaves without a tangent (see Variable::setTangent) are held fixed.
+    Dual evalForwardWithTangent();
     virtual Size size();
     Eigen::Index rows() { return this->size()(0); }
     Eigen::Index cols() { return this->size()(1); }
+    // as many as the operator takes, empty for leaves
+    const std::vector<ExpressionPtr>& operands() const { return m_operands; }
+    operators::Ptr op() const { return m_op; }
+    // increases whenever the value of this node changes
+    unsigned version() const { return m_version; }
+    // whether a trainable variable is reachable from this node. up to date after differentiateBackward(),
+    // nodes without it are skipped during backpropagation.
+    bool requiresGradient() const { return m_requiresGradient; }
+    // with checkpointing enabled on the root, evalForward() and differentiateBackward() keep only the values
+    // of checkpoints (and of the root). everything else is dropped once it is consumed and recomputed from the
+    // nearest checkpoint when backward needs it. more checkpoints, less recomputation.
+    void setCheckpointing(bool enabled) { m_checkpointing = enabled; }
+    void setCheckpoint(bool checkpoint) { m_checkpoint = checkpoint; }
+    bool isCheckpoint() const { return m_checkpoint; }
+    bool isReleased() const { return m_released; }
+    // drops all cached values. not needed after changing leaves through setValue() or valueForWrite().
     void reset();
+    // all nodes reachable from this one, each exactly once, every node before the nodes it depends on
+    const std::vector<Expression*>& tape();
+    friend std::vector<ArrayXX> hvp(const ExpressionPtr& f, const std::vector<std::shared_ptr<Variable>>& params, const std::vector<ArrayXX>& v);
 protected:
     Expression() {}
+    // the value as of the last evaluation, without bringing it up to date
+    virtual const ArrayXX& current() const { return m_aOpb; }
+    unsigned m_version = 0;
+    bool m_requiresGradient = false;
+    ArrayXX m_tangent;
+    bool m_hasTangent = false;
+    ArrayXX m_adjointTangent;
+private:
+    // whether an operand changed since the last evaluation
+    bool stale() const;
+    void update();
+    void updateRequiresGradient();
+    void rematerialise();
+    bool releasable() const { return m_op && !m_checkpoint; }
+    void release();
+    void accumulateAdjoint(const ConstArrayRef& adjoint);
+    Eigen::Map<ArrayXX> contribution();
+    void commitContribution(const Eigen::Map<ArrayXX>& contribution);
+    void backpropagate();
+    // per thread buffers, valid until the next call
+    const operators::Operands& operandValues() const;
+    const operators::Operands& operandTangents() const;
 };
 
 class Variable : public Expression {
     ArrayXX m_value;
     ArrayXX m_gradient;
+    bool m_mutable = false;
 
 public:
-    Variable(ArrayXX v) : m_value(v), m_gradient(ArrayXX::Constant(v.rows(), v.cols(), 0)) {}
-    Variable(Eigen::Index rows, Eigen::Index cols) : m_value(ArrayXX(rows, cols)), m_gradient(ArrayXX::Constant(rows, cols, 0)) {}
+    Variable(ArrayXX v) : m_value(v), m_gradient(ArrayXX::Constant(v.rows(), v.cols(), 0)) { m_requiresGradient = true; }
+    Variable(Eigen::Index rows, Eigen::Index cols) : m_value(ArrayXX(rows, cols)), m_gradient(ArrayXX::Constant(rows, cols, 0)) { m_requiresGradient = true; }
 
-    virtual ArrayXX evalForward() override;
+    virtual const ArrayXX& evalForward() override;
     virtual Size size() override { return {m_value.rows(), m_value.cols()}; }
-    virtual void differentiateBackward(const ArrayXX& factors) override;
-    ArrayXX& value() { return m_value; }
+    virtual void differentiateBackward(const ConstArrayRef& factors) override;
+    const ArrayXX& value() const { return m_value; }
+    // for writing in place, counts as a change of the value
+    ArrayXX& valueForWrite() { markChanged(); return m_value; }
+    // counts as a change only if the value differs
+    void setValue(const ConstArrayRef& value);
+    // nodes depending on this one are evaluated again by the next evalForward()
+    void markChanged() { ++m_version; }
     void resetGradient();
-    ArrayXX gradient() { return m_gradient; }
+    const ArrayXX& gradient() const { return m_gradient; }
+    void setTangent(const ConstArrayRef& tangent) { m_tangent = tangent; m_hasTangent = true; }
+    void clearTangent() { m_hasTangent = false; }
+    // frozen variables receive no gradient
+    void setRequiresGradient(bool requiresGradient) { m_requiresGradient = requiresGradient; }
+    // marks a constant whose value changes after the graph was built (e.g. network inputs), so that
+    // graph passes don't rely on its value
+    void setMutable(bool isMutable) { m_mutable = isMutable; }
+    bool isMutable() const { return m_mutable; }
+    // reads the value in place, without going through valueForWrite()
+    friend class Plan;
+protected:
+    virtual const ArrayXX& current() const override { return m_value; }
+public:
 
 	static inline std::shared_ptr<Variable> make(ArrayXX v) { return std::make_shared<Variable>(std::move(v)); }
 	static inline std::shared_ptr<Variable> make(Eigen::Index rows, Eigen::Index cols) { return std::make_shared<Variable>(rows, cols); }
@@ -88,9 +174,9 @@ using VariablePtr = std::shared_ptr<Variable>;
 
 class Constant : public Variable {
 public:
-	Constant(ArrayXX v) : Variable(v) {}
-	Constant(Eigen::Index rows, Eigen::Index cols) : Variable(rows, cols) {}
-    virtual void differentiateBackward(const ArrayXX&) override {}
+	Constant(ArrayXX v) : Variable(v) { m_requiresGradient = false; }
+	Constant(Eigen::Index rows, Eigen::Index cols) : Variable(rows, cols) { m_requiresGradient = false; }
+    virtual void differentiateBackward(const ConstArrayRef&) override {}
 	static inline std::shared_ptr<Variable> make(ArrayXX v) { return std::make_shared<Constant>(std::move(v)); }
 	static inline std::shared_ptr<Variable> make(Eigen::Index rows, Eigen::Index cols) { return std::make_shared<Constant>(rows, cols); }
 	static inline std::shared_ptr<Variable> make(Eigen::Index rows, Eigen::Index cols, float value) { return make(ArrayXX::Constant(rows, cols, value)); }
@@ -113,5 +199,12 @@ ExpressionPtr cwisediv (const ExpressionPtr& a, const ExpressionPtr& b);
 ExpressionPtr matmul(const ExpressionPtr& a, const ExpressionPtr& b);
 ExpressionPtr reduceSum(const ExpressionPtr &a);
 ExpressionPtr reduceProd(const ExpressionPtr &a);
+// one node instead of a chain of additions
+ExpressionPtr sum(const std::vector<ExpressionPtr>& terms);
+
+// hessian of the scalar f times v, by forward over reverse differentiation: the backward pass is differentiated
+// along the tangents v of params, at about twice the cost of a gradient. gradients are left alone, and
+// leaves other than params must not carry tangents. returns one array per parameter.
+std::vector<ArrayXX> hvp(const ExpressionPtr& f, const std::vector<VariablePtr>& params, const std::vector<ArrayXX>& v);
 
 #endif // EXPRESSION_H
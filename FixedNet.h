@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FIXEDNET_H
+#define FIXEDNET_H
+
+#include <memory>
+#include <random>
+
+#include <QtGlobal>
+
+#include "Eigen/Core"
+#include "nn.h"
+
+// networks with compile time layer sizes, for small latency critical models. same semantics as nn::Net with
+// nn::Layer (out = activation(W * in - b)), softmax classification and the nn::crossEntropy cost, but without a
+// graph: every layer is a template instance, sizes are known to the compiler and the activation is called statically.
+// weights live in one heap allocation each and are accessed through fixed size maps, everything else is a member.
+namespace nn {
+
+// element wise activations, matching their expression counterparts
+struct FixedRelu {
+    template<typename In, typename Out>
+    static void eval(const In& x, Out& out) { out = x.array().max(x.array() * 0.01f).matrix(); }
+    // dx = back * activation'(x)
+    template<typename In, typename Back, typename Out>
+    static void chain(const In& x, const In&, const Back& back, Out& dx) {
+        dx = (back.array() * ((x.array() > 0.f).template cast<float>() * 0.99f + 0.01f)).matrix();
+    }
+};
+
+struct FixedSigmoid {
+    template<typename In, typename Out>
+    static void eval(const In& x, Out& out) { out = (1.f / (1.f + (-x.array()).exp())).matrix(); }
+    template<typename In, typename Back, typename Out>
+    static void chain(const In&, const In& y, const Back& back, Out& dx) {
+        dx = (back.array() * y.array() * (1.f - y.array())).matrix();
+    }
+};
+
+namespace fixed {
+template<int Rows, int Cols>
+class Weights {
+    Eigen::MatrixXf m_storage;
+public:
+    using Map = Eigen::Map<Eigen::Matrix<float, Rows, Cols>, Eigen::Aligned16>;
+    using ConstMap = Eigen::Map<const Eigen::Matrix<float, Rows, Cols>, Eigen::Aligned16>;
+    Weights() : m_storage(Eigen::MatrixXf::Zero(Rows, Cols)) {}
+    Map map() { return Map(m_storage.data()); }
+    ConstMap map() const { return ConstMap(m_storage.data()); }
+};
+
+// layer In -> Out and all layers after it
+template<typename Activation, int In, int Out, int... Rest>
+struct Layers {
+    using Next = Layers<Activation, Out, Rest...>;
+    using InVector = Eigen::Matrix<float, In, 1>;
+    using OutVector = Eigen::Matrix<float, Out, 1>;
+    using Result = typename Next::Result;
+    static const int nLayers = Next::nLayers + 1;
+
+    Weights<Out, In> W;
+    Weights<Out, In> gradW;
+    OutVector b = OutVector::Zero();
+    OutVector gradb = OutVector::Zero();
+    OutVector pre;
+    OutVector out;
+    OutVector back;
+    Next next;
+
+    const Result& forward(const InVector& x) {
+        pre.noalias() = W.map() * x;
+        pre -= b;
+        Activation::eval(pre, out);
+        return next.forward(out);
+    }
+    float cost(const Result& target) const { return next.cost(target); }
+    // expects the values of the preceding forward(x). dx may be nullptr for the first layer.
+    void backward(const InVector& x, const Result& target, InVector* dx) {
+        next.backward(out, target, &back);
+        OutVector dpre;
+        Activation::chain(pre, out, back, dpre);
+        gradW.map().noalias() += dpre * x.transpose();
+        gradb -= dpre;
+        if (dx)
+            dx->noalias() = W.map().transpose() * dpre;
+    }
+    void applyGradient(float learningRate) {
+        W.map() -= gradW.map() * learningRate;
+        b -= gradb * learningRate;
+        next.applyGradient(learningRate);
+    }
+    void resetGradient() {
+        gradW.map().setZero();
+        gradb.setZero();
+        next.resetGradient();
+    }
+    template<typename Init>
+    void initialise(Init& init) {
+        W.map() = W.map().unaryExpr([&init](float) { return init(); });
+        next.initialise(init);
+    }
+    void copyFrom(const std::vector<LayerPtr>& layers, size_t index) {
+        Q_ASSERT(layers[index]->W->rows() == Out && layers[index]->W->cols() == In);
+        W.map() = layers[index]->W->value().matrix();
+        b = layers[index]->b->value().matrix();
+        next.copyFrom(layers, index + 1);
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// the classification layer: softmax, and the cross entropy cost
+template<typename Activation, int In, int Out>
+struct Layers<Activation, In, Out> {
+    using InVector = Eigen::Matrix<float, In, 1>;
+    using OutVector = Eigen::Matrix<float, Out, 1>;
+    using Result = OutVector;
+    static const int nLayers = 1;
+
+    Weights<Out, In> W;
+    Weights<Out, In> gradW;
+    OutVector b = OutVector::Zero();
+    OutVector gradb = OutVector::Zero();
+    OutVector pre;
+    OutVector out;
+
+    const Result& forward(const InVector& x) {
+        pre.noalias() = W.map() * x;
+        pre -= b;
+        out = (pre.array() - pre.maxCoeff()).exp().matrix();
+        out /= out.sum();
+        return out;
+    }
+    float cost(const Result& target) const {
+        return -(target.array() * (out.array() + 0.00000001f).log()).sum();
+    }
+    void backward(const InVector& x, const Result& target, InVector* dx) {
+        // through the cost and the softmax jacobian: dpre = p * (g - <p, g>)
+        const OutVector g = (-target.array() / (out.array() + 0.00000001f)).matrix();
+        const OutVector dpre = (out.array() * (g.array() - out.dot(g))).matrix();
+        gradW.map().noalias() += dpre * x.transpose();
+        gradb -= dpre;
+        if (dx)
+            dx->noalias() = W.map().transpose() * dpre;
+    }
+    void applyGradient(float learningRate) {
+        W.map() -= gradW.map() * learningRate;
+        b -= gradb * learningRate;
+    }
+    void resetGradient() {
+        gradW.map().setZero();
+        gradb.setZero();
+    }
+    template<typename Init>
+    void initialise(Init& init) {
+        W.map() = W.map().unaryExpr([&init](float) { return init(); });
+    }
+    void copyFrom(const std::vector<LayerPtr>& layers, size_t index) {
+        Q_ASSERT(index + 1 == layers.size());
+        Q_ASSERT(layers[index]->W->rows() == Out && layers[index]->W->cols() == In);
+        W.map() = layers[index]->W->value().matrix();
+        b = layers[index]->b->value().matrix();
+    }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+}
+
+template<typename Activation, int... Sizes>
+class BasicFixedNet {
+public:
+    using Layers = fixed::Layers<Activation, Sizes...>;
+private:
+    Layers m_layers;
+public:
+    using Input = typename Layers::InVector;
+    using Output = typename Layers::Result;
+    static const int nLayers = Layers::nLayers;
+    float learningRate = 0.1f;
+
+    // weights drawn like in nn::Layer::make
+    BasicFixedNet() {
+        static std::default_random_engine generator;
+        std::normal_distribution<float> distribution(0.f, 0.2f);
+        auto normal = [&]() { return distribution(generator); };
+        m_layers.initialise(normal);
+    }
+    BasicFixedNet(const BasicFixedNet&) = delete;
+
+    // valid until the next call
+    const Output& output(const Input& input) { return m_layers.forward(input); }
+    float loss(const Input& input, const Output& target) {
+        m_layers.forward(input);
+        return m_layers.cost(target);
+    }
+    // loss and gradient in one go, gradients are accumulated until the next resetGradient()
+    float accumulateGradient(const Input& input, const Output& target) {
+        const float error = loss(input, target);
+        m_layers.backward(input, target, nullptr);
+        return error;
+    }
+    void applyGradient() { m_layers.applyGradient(learningRate); }
+    void resetGradient() { m_layers.resetGradient(); }
+    float learn(const Input& input, const Output& target) {
+        resetGradient();
+        const float error = accumulateGradient(input, target);
+        applyGradient();
+        return error;
+    }
+    // takes over the weights of a dynamic net of the same shape
+    void copyFrom(const Net& net) {
+        Q_ASSERT(net.layers.size() == size_t(nLayers));
+        m_layers.copyFrom(net.layers, 0);
+        learningRate = net.learningRate;
+    }
+    // first layer, the following ones are chained through next
+    const Layers& layers() const { return m_layers; }
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// hidden layers with the leaky relu, like main.cpp: FixedNet<784, 64, 64, 10>
+template<int... Sizes>
+using FixedNet = BasicFixedNet<FixedRelu, Sizes...>;
+}
+
+#endif // FIXEDNET_H
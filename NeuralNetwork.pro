@@ -37,17 +37,27 @@ CONFIG -= app_bundle
 # deprecated API in order to know how to port your code away from it.
 DEFINES += QT_DEPRECATED_WARNINGS
 
+# the tests compare generatedNet.h with the output of the code generator
+DEFINES += SOURCE_DIR=\\\"$$PWD\\\"
+
 # You can also make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+        Arena.cpp \
+        Benchmarks.cpp \
         Expression.cpp \
+        Plan.cpp \
         Tests.cpp \
+        ThreadPool.cpp \
+        codegen.cpp \
         main.cpp \
         nn.cpp \
-        operators.cpp
+        operators.cpp \
+        passes.cpp \
+        serialization.cpp
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -55,7 +65,16 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 HEADERS += \
+    Arena.h \
+    Benchmarks.h \
     Expression.h \
+    FixedNet.h \
+    Plan.h \
     Tests.h \
+    ThreadPool.h \
+    codegen.h \
+    generatedNet.h \
     nn.h \
-    operators.h
+    operators.h \
+    passes.h \
+    serialization.h
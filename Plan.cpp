@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Plan.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <QtGlobal>
+
+#include "Arena.h"
+#include "operators.h"
+#include "passes.h"
+
+namespace {
+struct Buffer {
+    Eigen::Index size;
+    int begin;
+    int end;
+    Eigen::Index* offset;
+};
+
+// greedy by size: larger buffers are placed first, each at the lowest offset that does not collide
+// with an already placed buffer whose lifetime overlaps. returns the size of the workspace.
+Eigen::Index assignOffsets(std::vector<Buffer> buffers)
+{
+    std::stable_sort(buffers.begin(), buffers.end(), [](const Buffer& l, const Buffer& r) { return l.size > r.size; });
+    Eigen::Index workspaceSize = 0;
+    std::vector<const Buffer*> placed;
+    std::vector<const Buffer*> colliding;
+    for (auto& buffer : buffers) {
+        colliding.clear();
+        for (auto other : placed) {
+            if (other->begin <= buffer.end && buffer.begin <= other->end)
+                colliding.push_back(other);
+        }
+        std::sort(colliding.begin(), colliding.end(), [](const Buffer* l, const Buffer* r) { return *l->offset < *r->offset; });
+        Eigen::Index offset = 0;
+        for (auto other : colliding) {
+            if (offset + buffer.size <= *other->offset)
+                break;
+            offset = std::max(offset, *other->offset + other->size);
+        }
+        *buffer.offset = offset;
+        workspaceSize = std::max(workspaceSize, offset + buffer.size);
+        placed.push_back(&buffer);
+    }
+    return workspaceSize;
+}
+
+// floats per tile of a fused step
+const Eigen::Index tileSize = 512;
+
+// operators with up to two operands are called through the opcode switch, variadic ones through their
+// n-ary members. valueOf maps a slot to its value.
+template<typename ValueOf>
+void evaluate(const Plan::Instruction& instruction, const ValueOf& valueOf, ArrayRef out)
+{
+    if (instruction.op->arity() < 0) {
+        // per thread, steps may run concurrently
+        static thread_local operators::Operands x;
+        x.clear();
+        for (int input : instruction.operands) {
+            const auto value = valueOf(input);
+            x.emplace_back(value.data(), value.rows(), value.cols());
+        }
+        instruction.op->evalN(x, out);
+        return;
+    }
+    operators::eval(instruction.op->opcode(), valueOf(instruction.operands.front()), valueOf(instruction.operands.back()), out);
+}
+
+// contribution of the instruction to the adjoint of its k-th operand
+template<typename ValueOf>
+void differentiate(const Plan::Instruction& instruction, int k, const ValueOf& valueOf, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    if (instruction.op->arity() < 0) {
+        // per thread, steps may run concurrently
+        static thread_local operators::Operands x;
+        x.clear();
+        for (int input : instruction.operands) {
+            const auto value = valueOf(input);
+            x.emplace_back(value.data(), value.rows(), value.cols());
+        }
+        instruction.op->vjpN(k, x, result, back, out);
+        return;
+    }
+    const auto a = valueOf(instruction.operands.front());
+    const auto b = valueOf(instruction.operands.back());
+    if (k == 0)
+        operators::vjpA(instruction.op->opcode(), a, b, result, back, out);
+    else
+        operators::vjpB(instruction.op->opcode(), a, b, result, back, out);
+}
+}
+
+Plan::Plan(ExpressionPtr root, Mode mode) : m_root(passes::optimize(root)), m_mode(mode)
+{
+    // the tape lists consumers before producers, instructions need it the other way round
+    std::vector<Expression*> nodes = m_root->tape();
+    std::reverse(nodes.begin(), nodes.end());
+
+    std::unordered_map<Expression*, int> slotOf;
+    for (auto node : nodes) {
+        const int slot = int(m_slots.size());
+        slotOf[node] = slot;
+        Variable* leaf = nullptr;
+        bool requiresGradient = false;
+        if (node->op()) {
+            Instruction instruction = {node->op(), {}, slot};
+            for (const auto& operand : node->operands()) {
+                instruction.operands.push_back(slotOf.at(operand.get()));
+                requiresGradient = requiresGradient || m_slots[size_t(instruction.operands.back())].requiresGradient;
+            }
+            m_instructions.push_back(std::move(instruction));
+        }
+        else {
+            leaf = dynamic_cast<Variable*>(node);
+            Q_ASSERT(leaf);
+            requiresGradient = leaf->requiresGradient() && mode == Mode::Training;
+        }
+        m_slots.push_back({leaf, node->rows(), node->cols(), -1, -1, -1, requiresGradient});
+    }
+    m_rootSlot = slotOf.at(m_root.get());
+    m_adjointValid.resize(m_slots.size(), false);
+    fuse();
+    planMemory();
+    planSchedule();
+}
+
+void Plan::fuse()
+{
+    const int n = int(m_instructions.size());
+    std::vector<int> uses(m_slots.size(), 0);
+    std::vector<int> consumer(m_slots.size(), -1);
+    for (int i = 0; i < n; ++i) {
+        for (int input : m_instructions[size_t(i)].operands) {
+            ++uses[size_t(input)];
+            consumer[size_t(input)] = i;
+        }
+    }
+    auto sameSize = [this](int l, int r) {
+        return m_slots[size_t(l)].rows == m_slots[size_t(r)].rows && m_slots[size_t(l)].cols == m_slots[size_t(r)].cols;
+    };
+    // operands of size 1x1 are broadcast over the tile. instructions repeating rows or columns are not fused.
+    auto elementwise = [this, &sameSize](const Instruction& instruction) {
+        if (!instruction.op->elementwise())
+            return false;
+        for (int input : instruction.operands) {
+            const auto& slot = m_slots[size_t(input)];
+            if (!sameSize(input, instruction.out) && slot.rows * slot.cols != 1)
+                return false;
+        }
+        return true;
+    };
+
+    // an element wise instruction joins the step of its consumer, if that is its only use and element wise as well.
+    // steps are named after the instruction producing their result.
+    std::vector<int> stepOf(m_instructions.size());
+    for (int i = n - 1; i >= 0; --i) {
+        const auto& instruction = m_instructions[size_t(i)];
+        const int c = consumer[size_t(instruction.out)];
+        const bool fusable = c >= 0 && uses[size_t(instruction.out)] == 1
+                && elementwise(instruction) && elementwise(m_instructions[size_t(c)])
+                && sameSize(instruction.out, m_instructions[size_t(c)].out);
+        stepOf[size_t(i)] = fusable ? stepOf[size_t(c)] : i;
+    }
+
+    // results of other steps are consumed only by instructions following them, so ordering the steps
+    // by their last instruction keeps the program in topological order
+    std::vector<std::vector<int>> members(m_instructions.size());
+    for (int i = 0; i < n; ++i)
+        members[size_t(stepOf[size_t(i)])].push_back(i);
+    std::vector<Instruction> instructions;
+    for (int i = 0; i < n; ++i) {
+        if (members[size_t(i)].empty())
+            continue;
+        Step s = {int(instructions.size()), int(instructions.size() + members[size_t(i)].size()), {}};
+        for (int member : members[size_t(i)])
+            instructions.push_back(m_instructions[size_t(member)]);
+        const bool fused = s.end - s.begin > 1;
+        for (int j = s.begin; j < s.end; ++j) {
+            const auto& instruction = instructions[size_t(j)];
+            if (fused && j < s.end - 1)
+                m_slots[size_t(instruction.out)].fusedIndex = j - s.begin;
+            for (int input : instruction.operands) {
+                if (m_slots[size_t(input)].fusedIndex == -1 && std::find(s.inputs.begin(), s.inputs.end(), input) == s.inputs.end())
+                    s.inputs.push_back(input);
+            }
+        }
+        m_steps.push_back(std::move(s));
+    }
+    m_instructions = std::move(instructions);
+}
+
+// whether differentiating the step reads the values of its inputs. fused steps recompute their
+// intermediate values from the inputs, their result is not read.
+bool Plan::backwardReadsInputs(const Step& step) const
+{
+    const auto& instruction = m_instructions[size_t(step.end - 1)];
+    if (m_mode == Mode::Inference || !m_slots[size_t(instruction.out)].requiresGradient)
+        return false;
+    return step.end - step.begin > 1 || instruction.op->vjpReadsOperands();
+}
+
+bool Plan::backwardReadsResult(const Step& step) const
+{
+    const auto& instruction = m_instructions[size_t(step.end - 1)];
+    if (m_mode == Mode::Inference || !m_slots[size_t(instruction.out)].requiresGradient)
+        return false;
+    return step.end - step.begin == 1 && instruction.op->vjpReadsResult();
+}
+
+void Plan::planMemory()
+{
+    // time line: step k is evaluated at time k and differentiated at time 2m - 1 - k.
+    // for inference there is no backward part, values live until their last consumer.
+    const int m = int(m_steps.size());
+    const bool training = m_mode == Mode::Training;
+    const int end = training ? 2 * m : m;
+    std::vector<int> valueEnd(m_slots.size(), -1);
+    std::vector<int> adjointBegin(m_slots.size(), end);
+    std::vector<int> adjointEnd(m_slots.size(), -1);
+    for (int k = 0; k < m; ++k) {
+        const auto& step = m_steps[size_t(k)];
+        const int out = m_instructions[size_t(step.end - 1)].out;
+        const int backwardTime = training ? 2 * m - 1 - k : k;
+        adjointEnd[size_t(out)] = backwardTime;
+        valueEnd[size_t(out)] = std::max(valueEnd[size_t(out)], backwardReadsResult(step) ? backwardTime : k);
+        for (int input : step.inputs) {
+            valueEnd[size_t(input)] = std::max(valueEnd[size_t(input)], backwardReadsInputs(step) ? backwardTime : k);
+            adjointBegin[size_t(input)] = std::min(adjointBegin[size_t(input)], backwardTime);
+        }
+    }
+    // the result stays readable until the next forward
+    valueEnd[size_t(m_rootSlot)] = end;
+    adjointBegin[size_t(m_rootSlot)] = std::min(adjointBegin[size_t(m_rootSlot)], m);
+
+    // in-place: an element wise step whose input of the same size is last read by the step itself takes
+    // over the buffer of that input. element i of the result only depends on element i of the input,
+    // which has been read when it is written.
+    std::vector<Buffer> buffers;
+    std::vector<int> bufferOf(m_slots.size(), -1);
+    std::vector<std::pair<int, int>> inPlace;
+    for (int k = 0; k < m; ++k) {
+        const auto& step = m_steps[size_t(k)];
+        const int out = m_instructions[size_t(step.end - 1)].out;
+        auto& slot = m_slots[size_t(out)];
+        int reused = -1;
+        if (step.end - step.begin > 1 || m_instructions[size_t(step.begin)].op->elementwise()) {
+            for (int input : step.inputs) {
+                const auto& candidate = m_slots[size_t(input)];
+                if (bufferOf[size_t(input)] != -1 && valueEnd[size_t(input)] == k && candidate.rows == slot.rows && candidate.cols == slot.cols) {
+                    reused = input;
+                    break;
+                }
+            }
+        }
+        if (reused != -1) {
+            bufferOf[size_t(out)] = bufferOf[size_t(reused)];
+            buffers[size_t(bufferOf[size_t(out)])].end = valueEnd[size_t(out)];
+            inPlace.emplace_back(out, reused);
+        }
+        else {
+            bufferOf[size_t(out)] = int(buffers.size());
+            buffers.push_back({padded(slot.rows * slot.cols), k, valueEnd[size_t(out)], &slot.value});
+        }
+        if (slot.requiresGradient)
+            buffers.push_back({padded(slot.rows * slot.cols), adjointBegin[size_t(out)], adjointEnd[size_t(out)], &slot.adjoint});
+    }
+    m_workspace.resize(assignOffsets(std::move(buffers)));
+    for (const auto& alias : inPlace)
+        m_slots[size_t(alias.first)].value = m_slots[size_t(alias.second)].value;
+}
+
+void Plan::planSchedule()
+{
+    // memory ranges read or written by every task. leaves are only read, except for their gradients,
+    // which are given pseudo ranges behind the workspace.
+    struct Access {
+        Eigen::Index begin;
+        Eigen::Index end;
+        bool write;
+    };
+    const Eigen::Index gradients = m_workspace.size();
+    auto valueOf = [this](int slot, bool write) {
+        const auto& s = m_slots[size_t(slot)];
+        return Access{s.value, s.value + s.rows * s.cols, write};
+    };
+    auto adjointOf = [this, gradients](int slot) {
+        const auto& s = m_slots[size_t(slot)];
+        if (s.leaf)
+            return Access{gradients + slot, gradients + slot + 1, true};
+        return Access{s.adjoint, s.adjoint + s.rows * s.cols, true};
+    };
+
+    const int m = int(m_steps.size());
+    std::vector<std::vector<Access>> forwardAccesses(m_steps.size());
+    std::vector<std::vector<Access>> backwardAccesses(m_steps.size());
+    for (int k = 0; k < m; ++k) {
+        const auto& step = m_steps[size_t(k)];
+        const int out = m_instructions[size_t(step.end - 1)].out;
+        auto& forward = forwardAccesses[size_t(k)];
+        auto& backward = backwardAccesses[size_t(m - 1 - k)];
+        forward.push_back(valueOf(out, true));
+        if (backwardReadsResult(step))
+            backward.push_back(valueOf(out, false));
+        if (m_slots[size_t(out)].requiresGradient)
+            backward.push_back(adjointOf(out));
+        for (int input : step.inputs) {
+            if (m_slots[size_t(input)].leaf == nullptr) {
+                forward.push_back(valueOf(input, false));
+                if (backwardReadsInputs(step))
+                    backward.push_back(valueOf(input, false));
+            }
+            if (m_slots[size_t(input)].requiresGradient)
+                backward.push_back(adjointOf(input));
+        }
+    }
+
+    auto conflict = [](const std::vector<Access>& earlier, const std::vector<Access>& later) {
+        for (const auto& l : earlier) {
+            for (const auto& r : later) {
+                if ((l.write || r.write) && l.begin < r.end && r.begin < l.end)
+                    return true;
+            }
+        }
+        return false;
+    };
+    auto build = [m, &conflict](const std::vector<std::vector<Access>>& accesses, ThreadPool::Graph& graph) {
+        graph.nDependencies.assign(size_t(m), 0);
+        graph.dependents.assign(size_t(m), {});
+        for (int j = 0; j < m; ++j) {
+            for (int i = 0; i < j; ++i) {
+                if (conflict(accesses[size_t(i)], accesses[size_t(j)])) {
+                    graph.dependents[size_t(i)].push_back(j);
+                    ++graph.nDependencies[size_t(j)];
+                }
+            }
+        }
+    };
+    build(forwardAccesses, m_forwardGraph);
+    build(backwardAccesses, m_backwardGraph);
+}
+
+Eigen::Map<ArrayXX> Plan::value(int slot)
+{
+    const auto& s = m_slots[size_t(slot)];
+    if (s.leaf) {
+        ArrayXX& leafValue = s.leaf->m_value;
+        Q_ASSERT(leafValue.rows() == s.rows && leafValue.cols() == s.cols);
+        return Eigen::Map<ArrayXX>(leafValue.data(), s.rows, s.cols);
+    }
+    return Eigen::Map<ArrayXX>(m_workspace.data() + s.value, s.rows, s.cols);
+}
+
+Eigen::Map<ArrayXX> Plan::adjoint(int slot)
+{
+    const auto& s = m_slots[size_t(slot)];
+    return Eigen::Map<ArrayXX>(m_workspace.data() + s.adjoint, s.rows, s.cols);
+}
+
+Eigen::Map<const ArrayXX> Plan::forward()
+{
+    for (const auto& step : m_steps)
+        forwardStep(step);
+    const auto result = value(m_rootSlot);
+    return Eigen::Map<const ArrayXX>(result.data(), result.rows(), result.cols());
+}
+
+Eigen::Map<const ArrayXX> Plan::forward(ThreadPool& pool)
+{
+    pool.run(m_forwardGraph, [this](int task) { forwardStep(m_steps[size_t(task)]); });
+    const auto result = value(m_rootSlot);
+    return Eigen::Map<const ArrayXX>(result.data(), result.rows(), result.cols());
+}
+
+void Plan::backward(const ConstArrayRef& factors)
+{
+    // expects the values of the preceding forward()
+    Q_ASSERT(m_mode == Mode::Training);
+    if (!m_slots[size_t(m_rootSlot)].requiresGradient)
+        return;
+    accumulateAdjoint(m_rootSlot, factors);
+    for (auto it = m_steps.rbegin(); it != m_steps.rend(); ++it)
+        backwardStep(*it);
+}
+
+void Plan::backward(ThreadPool& pool, const ConstArrayRef& factors)
+{
+    Q_ASSERT(m_mode == Mode::Training);
+    if (!m_slots[size_t(m_rootSlot)].requiresGradient)
+        return;
+    accumulateAdjoint(m_rootSlot, factors);
+    const size_t m = m_steps.size();
+    pool.run(m_backwardGraph, [this, m](int task) { backwardStep(m_steps[m - 1 - size_t(task)]); });
+}
+
+void Plan::forwardStep(const Step& step)
+{
+    if (step.end - step.begin > 1) {
+        evalFused(step);
+        return;
+    }
+    const auto& instruction = m_instructions[size_t(step.begin)];
+    auto out = value(instruction.out);
+    evaluate(instruction, [this](int slot) { return value(slot); }, out);
+    Q_ASSERT(m_mode == Mode::Inference || !out.isNaN().any());
+    Q_ASSERT(m_mode == Mode::Inference || !out.isInf().any());
+}
+
+void Plan::backwardStep(const Step& step)
+{
+    const auto& instruction = m_instructions[size_t(step.end - 1)];
+    if (!m_adjointValid[size_t(instruction.out)])
+        return;
+    if (step.end - step.begin > 1) {
+        differentiateFused(step);
+        m_adjointValid[size_t(instruction.out)] = false;
+        return;
+    }
+    Arena::Scope scope(g_arena);
+    const auto result = value(instruction.out);
+    const auto adjoint = this->adjoint(instruction.out);
+    auto valueOf = [this](int slot) { return value(slot); };
+
+    for (size_t k = 0; k < instruction.operands.size(); ++k) {
+        const int input = instruction.operands[k];
+        if (!m_slots[size_t(input)].requiresGradient)
+            continue;
+        auto chained = contribution(input);
+        differentiate(instruction, int(k), valueOf, result, adjoint, chained);
+        commitContribution(input, chained);
+    }
+
+    m_adjointValid[size_t(instruction.out)] = false;
+}
+
+Eigen::Map<ArrayXX> Plan::tileValue(int slot, float* tiles, Eigen::Index offset, Eigen::Index length)
+{
+    const auto& s = m_slots[size_t(slot)];
+    if (s.fusedIndex >= 0)
+        return Eigen::Map<ArrayXX>(tiles + s.fusedIndex * tileSize, length, 1);
+    if (s.rows * s.cols == 1)
+        return Eigen::Map<ArrayXX>(value(slot).data(), 1, 1);
+    return Eigen::Map<ArrayXX>(value(slot).data() + offset, length, 1);
+}
+
+void Plan::evalTile(const Step& step, float* tiles, Eigen::Index offset, Eigen::Index length, bool storeResult)
+{
+    for (int i = step.begin; i < step.end; ++i) {
+        const auto& instruction = m_instructions[size_t(i)];
+        float* out = tiles + (i - step.begin) * tileSize;
+        if (storeResult && i == step.end - 1)
+            out = value(instruction.out).data() + offset;
+        auto result = Eigen::Map<ArrayXX>(out, length, 1);
+        evaluate(instruction, [this, tiles, offset, length](int slot) { return tileValue(slot, tiles, offset, length); }, result);
+    }
+}
+
+void Plan::evalFused(const Step& step)
+{
+    Arena::Scope scope(g_arena);
+    const auto& result = m_slots[size_t(m_instructions[size_t(step.end - 1)].out)];
+    const Eigen::Index size = result.rows * result.cols;
+    float* tiles = g_arena.allocate(tileSize, step.end - step.begin).data();
+    for (Eigen::Index offset = 0; offset < size; offset += tileSize)
+        evalTile(step, tiles, offset, std::min(tileSize, size - offset), true);
+    Q_ASSERT(m_mode == Mode::Inference || !value(m_instructions[size_t(step.end - 1)].out).isNaN().any());
+    Q_ASSERT(m_mode == Mode::Inference || !value(m_instructions[size_t(step.end - 1)].out).isInf().any());
+}
+
+void Plan::differentiateFused(const Step& step)
+{
+    // intermediate values are recomputed per tile, adjoints are propagated through the tile buffers and
+    // only the adjoints of the step inputs are written out.
+    Arena::Scope scope(g_arena);
+    const int count = step.end - step.begin;
+    const int out = m_instructions[size_t(step.end - 1)].out;
+    const Eigen::Index size = m_slots[size_t(out)].rows * m_slots[size_t(out)].cols;
+    float* values = g_arena.allocate(tileSize, count).data();
+    float* adjoints = g_arena.allocate(tileSize, count).data();
+    float* scratch = g_arena.allocate(tileSize, 1).data();
+
+    // leaves collect their contributions in scratch memory and receive them in one piece afterwards
+    // per thread, steps may be differentiated concurrently
+    static thread_local std::vector<float*> targets;
+    static thread_local std::vector<char> written;
+    targets.resize(step.inputs.size());
+    written.resize(step.inputs.size());
+    for (size_t k = 0; k < step.inputs.size(); ++k) {
+        const auto& input = m_slots[size_t(step.inputs[k])];
+        if (!input.requiresGradient)
+            continue;
+        targets[k] = input.leaf ? g_arena.allocate(input.rows, input.cols).data() : adjoint(step.inputs[k]).data();
+    }
+
+    // broadcast inputs collect the contributions of all tiles in their single element
+    std::fill(written.begin(), written.end(), false);
+    for (Eigen::Index offset = 0; offset < size; offset += tileSize) {
+        const Eigen::Index length = std::min(tileSize, size - offset);
+        evalTile(step, values, offset, length, false);
+        for (size_t k = 0; k < step.inputs.size(); ++k) {
+            const auto& input = m_slots[size_t(step.inputs[k])];
+            if (input.rows * input.cols != 1)
+                written[k] = false;
+        }
+
+        for (int i = step.end - 1; i >= step.begin; --i) {
+            const auto& instruction = m_instructions[size_t(i)];
+            const int j = i - step.begin;
+            if (!m_slots[size_t(instruction.out)].requiresGradient)
+                continue;
+            auto valueOf = [this, values, offset, length](int slot) { return tileValue(slot, values, offset, length); };
+            const auto result = Eigen::Map<ArrayXX>(values + j * tileSize, length, 1);
+            const auto back = (j == count - 1) ? Eigen::Map<ArrayXX>(adjoint(out).data() + offset, length, 1)
+                                               : Eigen::Map<ArrayXX>(adjoints + j * tileSize, length, 1);
+
+            for (size_t operand = 0; operand < instruction.operands.size(); ++operand) {
+                const int input = instruction.operands[operand];
+                const auto& slot = m_slots[size_t(input)];
+                if (!slot.requiresGradient)
+                    continue;
+                float* target = scratch;
+                bool accumulate = false;
+                size_t k = 0;
+                const bool broadcast = slot.fusedIndex == -1 && slot.rows * slot.cols == 1;
+                const Eigen::Index chainedOffset = broadcast ? 0 : offset;
+                const Eigen::Index chainedLength = broadcast ? 1 : length;
+                if (slot.fusedIndex >= 0) {
+                    // inner slots of the step have exactly one use
+                    target = adjoints + slot.fusedIndex * tileSize;
+                }
+                else {
+                    k = size_t(std::find(step.inputs.begin(), step.inputs.end(), input) - step.inputs.begin());
+                    accumulate = written[k] || (!slot.leaf && m_adjointValid[size_t(input)]);
+                    if (!accumulate)
+                        target = targets[k] + chainedOffset;
+                    written[k] = true;
+                }
+                auto chained = Eigen::Map<ArrayXX>(target, chainedLength, 1);
+                differentiate(instruction, int(operand), valueOf, result, back, chained);
+                if (accumulate)
+                    Eigen::Map<ArrayXX>(targets[k] + chainedOffset, chainedLength, 1) += chained;
+            }
+        }
+    }
+
+    for (size_t k = 0; k < step.inputs.size(); ++k) {
+        const int input = step.inputs[k];
+        const auto& slot = m_slots[size_t(input)];
+        if (!slot.requiresGradient)
+            continue;
+        if (slot.leaf)
+            slot.leaf->differentiateBackward(Eigen::Map<ArrayXX>(targets[k], slot.rows, slot.cols));
+        else
+            m_adjointValid[size_t(input)] = true;
+    }
+}
+
+Eigen::Map<ArrayXX> Plan::contribution(int slot)
+{
+    // the first contribution to an inner adjoint is written in place, everything else goes through scratch memory
+    const auto& s = m_slots[size_t(slot)];
+    if (!s.leaf && !m_adjointValid[size_t(slot)])
+        return adjoint(slot);
+    return g_arena.allocate(s.rows, s.cols);
+}
+
+void Plan::commitContribution(int slot, const Eigen::Map<ArrayXX>& contribution)
+{
+    Q_ASSERT(!contribution.isNaN().any());
+    Q_ASSERT(!contribution.isInf().any());
+    if (m_slots[size_t(slot)].leaf) {
+        // leaves accumulate straight into their gradient and need no buffer of their own
+        m_slots[size_t(slot)].leaf->differentiateBackward(contribution);
+    }
+    else if (m_adjointValid[size_t(slot)]) {
+        adjoint(slot) += contribution;
+    }
+    else {
+        m_adjointValid[size_t(slot)] = true;
+    }
+}
+
+void Plan::accumulateAdjoint(int slot, const ConstArrayRef& adjoint)
+{
+    Q_ASSERT(!adjoint.isNaN().any());
+    Q_ASSERT(!adjoint.isInf().any());
+    if (m_slots[size_t(slot)].leaf) {
+        m_slots[size_t(slot)].leaf->differentiateBackward(adjoint);
+        return;
+    }
+    auto target = this->adjoint(slot);
+    if (m_adjointValid[size_t(slot)]) {
+        target += adjoint;
+    }
+    else {
+        target = adjoint;
+        m_adjointValid[size_t(slot)] = true;
+    }
+}
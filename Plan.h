@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <memory>
+#include <vector>
+
+#include "Eigen/Core"
+#include "Arena.h"
+#include "Expression.h"
+#include "operators.h"
+#include "ThreadPool.h"
+
+// flat, index based form of an expression graph. common subexpressions are merged first, then every
+// inner node becomes one instruction, every node one slot. forward and backward are plain loops over the instruction array,
+// operators are dispatched by a switch over their opcode.
+//
+// values and adjoints of the inner nodes live in a single workspace. a liveness analysis over
+// the instruction array assigns each buffer an offset, buffers with disjoint lifetimes share memory.
+//
+// maximal trees of element wise instructions are fused into one step. such a step runs tile by tile,
+// intermediate values and adjoints only exist in cache sized tile buffers.
+//
+// a step that is element wise may write its result over one of its inputs, if nothing reads that input
+// afterwards. the backward pass counts as well: operators declare whether their vjp reads operands or result.
+//
+// for concurrent execution, a step depends on every earlier step (in the order of the serial program)
+// that touches overlapping workspace memory. this covers the data flow as well as the reuse of buffers.
+//
+// slots that reach no trainable variable (Variable::requiresGradient() at construction time) are skipped by backward().
+class Plan {
+public:
+    struct Instruction {
+        operators::Ptr op;          // called through operators::eval() etc. with its opcode, not virtually
+        std::vector<int> operands;
+        int out;
+    };
+    struct Slot {
+        Variable* leaf;         // nullptr for inner nodes
+        Eigen::Index rows;
+        Eigen::Index cols;
+        Eigen::Index value;     // offset into the workspace, -1 for leaves
+        Eigen::Index adjoint;   // offset into the workspace, -1 for leaves
+        int fusedIndex;         // position inside its fused step, -1 if the slot is materialised
+        bool requiresGradient;  // reaches a trainable variable, otherwise the slot has no adjoint
+    };
+    struct Step {
+        int begin;                  // range of instructions, the last one produces the result
+        int end;
+        std::vector<int> inputs;    // slots read from outside of the step
+    };
+
+    enum class Mode {
+        Training,
+        // forward only: no adjoints, values are released as soon as their last consumer ran, no NaN/Inf checks
+        Inference
+    };
+
+    explicit Plan(ExpressionPtr root, Mode mode = Mode::Training);
+    Plan(const Plan&) = delete;
+    Eigen::Map<const ArrayXX> forward();
+    void backward(const ConstArrayRef& factors = ArrayXX::Constant(1, 1, 1));
+    // same as above, independent steps run concurrently
+    Eigen::Map<const ArrayXX> forward(ThreadPool& pool);
+    void backward(ThreadPool& pool, const ConstArrayRef& factors = ArrayXX::Constant(1, 1, 1));
+
+    const std::vector<Instruction>& instructions() const { return m_instructions; }
+    const std::vector<Slot>& slots() const { return m_slots; }
+    const std::vector<Step>& steps() const { return m_steps; }
+    size_t nSlots() const { return m_slots.size(); }
+    // in floats
+    Eigen::Index workspaceSize() const { return m_workspace.size(); }
+
+    static inline std::shared_ptr<Plan> make(ExpressionPtr root, Mode mode = Mode::Training) { return std::make_shared<Plan>(std::move(root), mode); }
+
+private:
+    ExpressionPtr m_root;
+    Mode m_mode;
+    std::vector<Instruction> m_instructions;
+    std::vector<Slot> m_slots;
+    std::vector<Step> m_steps;
+    std::vector<char> m_adjointValid;
+    ThreadPool::Graph m_forwardGraph;     // task k evaluates step k
+    ThreadPool::Graph m_backwardGraph;    // task k differentiates step m - 1 - k
+    AlignedBuffer m_workspace;
+    int m_rootSlot = -1;
+
+    void fuse();
+    bool backwardReadsInputs(const Step& step) const;
+    bool backwardReadsResult(const Step& step) const;
+    void planMemory();
+    void planSchedule();
+    void forwardStep(const Step& step);
+    void backwardStep(const Step& step);
+    void evalFused(const Step& step);
+    void differentiateFused(const Step& step);
+    void evalTile(const Step& step, float* tiles, Eigen::Index offset, Eigen::Index length, bool storeResult);
+    Eigen::Map<ArrayXX> tileValue(int slot, float* tiles, Eigen::Index offset, Eigen::Index length);
+    Eigen::Map<ArrayXX> value(int slot);
+    Eigen::Map<ArrayXX> adjoint(int slot);
+    void accumulateAdjoint(int slot, const ConstArrayRef& adjoint);
+    Eigen::Map<ArrayXX> contribution(int slot);
+    void commitContribution(int slot, const Eigen::Map<ArrayXX>& contribution);
+};
+using PlanPtr = std::shared_ptr<Plan>;
+
+#endif // PLAN_H
@@ -28,12 +28,31 @@
  */
 
 #include "Tests.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include <QtGlobal>
 
+#include "Arena.h"
+#include "codegen.h"
 #include "Expression.h"
+#include "FixedNet.h"
+#include "generatedNet.h"
 #include "nn.h"
+#include "operators.h"
+#include "passes.h"
+#include "serialization.h"
+#include "ThreadPool.h"
+
+// set by NeuralNetwork.pro, the tests run from the sources otherwise
+#ifndef SOURCE_DIR
+#define SOURCE_DIR "."
+#endif
 
 namespace {
 void testErr(std::string condition, std::string file, int line) {
@@ -61,8 +80,8 @@ void testSimpleDescent()
         f->reset();
         f->evalForward();
         f->differentiateBackward();
-        x->value() -= x->gradient() * learningRate;
-        y->value() -= y->gradient() * learningRate;
+        x->valueForWrite() -= x->gradient() * learningRate;
+        y->valueForWrite() -= y->gradient() * learningRate;
 //        std::cout << "f = " << f->evalForward() << std::endl;
 //        std::cout << "x = " << x->value().transpose() << std::endl;
 //        std::cout << "y = " << y->value().transpose() << std::endl;
@@ -182,7 +201,7 @@ void testLossGradients(ActivationFun activationFun, LossFunction lossFun) {
 	auto W = Variable::make(ArrayXX::Random(10, 10));
 
     auto target = Variable::make(ArrayXX::Zero(10, 1));
-	target->value()(0) = 1.f;
+	target->valueForWrite()(0) = 1.f;
 
 	auto pred = activationFun(relu(W * x));
     auto loss = lossFun(pred, target);
@@ -200,7 +219,7 @@ void testLossGradients(ActivationFun activationFun, LossFunction lossFun) {
 		std::cout << "W gradient: " << W->gradient() << std::endl;
 		std::cout << "Wx: " << W->value().matrix() * x->value().matrix() << std::endl;
         TUW_CHECK(std::abs(pred->evalForward().sum() - 1.f) < 0.001f);
-		W->value() -= W->gradient() * learningRate;
+		W->valueForWrite() -= W->gradient() * learningRate;
 //        std::cout << "f = " << f->evalForward() << std::endl;
 //        std::cout << "x = " << x->value().transpose() << std::endl;
 //        std::cout << "y = " << y->value().transpose() << std::endl;
@@ -241,6 +260,923 @@ void testSoftMax() {
 
 }
 
+void testDiamondBackward() {
+    std::cout << "testDiamondBackward()" << std::endl;
+
+    // every level triples the number of paths from the root to x, the gradient is 1.5^depth
+    const int depth = 40;
+    auto x = Variable::make(ArrayXX::Random(3, 1));
+    ExpressionPtr y = x;
+    for (int i = 0; i < depth; ++i)
+        y = cwisemul(y + y, Constant::make(3, 1, 0.5f)) + cwisemul(y, Constant::make(3, 1, 0.5f));
+    auto f = reduceSum(y);
+
+    f->evalForward();
+    f->differentiateBackward();
+    TUW_CHECK(f->tape().size() == size_t(6 * depth + 2));
+    TUW_CHECK((x->gradient() - std::pow(1.5f, float(depth))).abs().maxCoeff() < std::pow(1.5f, float(depth)) * 0.0001f);
+}
+
+void testPlan() {
+    std::cout << "testPlan()" << std::endl;
+
+    ArrayXX x = ArrayXX::Random(6, 1);
+    ArrayXX y = ArrayXX::Zero(4, 1);
+    y(2, 0) = 1.f;
+    auto net = nn::Net::make(x, y, {32, 32}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    TUW_CHECK(net->costPlan->instructions().size() + 1 <= net->costPlan->nSlots());
+
+    // values and adjoints of inner nodes share the workspace
+    Eigen::Index unshared = 0;
+    for (const auto& slot : net->costPlan->slots()) {
+        if (!slot.leaf)
+            unshared += 2 * slot.rows * slot.cols;
+    }
+    TUW_CHECK(net->costPlan->workspaceSize() < unshared);
+
+    net->resetGradient();
+    float expressionLoss = net->loss(x, y);
+    net->costOutExpr->differentiateBackward();
+    std::vector<ArrayXX> expressionGradients;
+    for (const auto& layer : net->layers)
+        expressionGradients.push_back(layer->W->gradient());
+
+    net->resetGradient();
+    float planLoss = net->accumulateGradient(x, y);
+    TUW_CHECK(std::abs(planLoss - expressionLoss) < 0.00001f);
+    for (size_t i = 0; i < net->layers.size(); ++i)
+        TUW_CHECK((net->layers[i]->W->gradient() - expressionGradients[i]).abs().maxCoeff() < 0.00001f);
+
+    net->accumulateGradient(x, y);
+    for (size_t i = 0; i < net->layers.size(); ++i)
+        TUW_CHECK((net->layers[i]->W->gradient() - 2 * expressionGradients[i]).abs().maxCoeff() < 0.00001f);
+}
+
+void testArena() {
+    std::cout << "testArena()" << std::endl;
+
+    Arena arena;
+    {
+        Arena::Scope scope(arena);
+        auto a = arena.allocate(10, 10);
+        auto b = arena.allocate(1000, 10);
+        a.setConstant(1);
+        b.setConstant(2);
+        TUW_CHECK(a.data() + 100 <= b.data());
+        TUW_CHECK(arena.nBlocks() == 2);
+    }
+    auto c = arena.allocate(10, 10);
+    TUW_CHECK(arena.nBlocks() == 2);
+    c.setConstant(3);
+
+    arena.reset();
+    const auto capacity = arena.capacity();
+    TUW_CHECK(arena.nBlocks() == 1);
+    arena.allocate(10, 10);
+    arena.allocate(1000, 10);
+    TUW_CHECK(arena.nBlocks() == 1);
+    TUW_CHECK(arena.capacity() == capacity);
+
+    // every allocation starts a cache line
+    for (int size : {1, 17, 64}) {
+        auto d = arena.allocate(size, 1);
+        TUW_CHECK(reinterpret_cast<uintptr_t>(d.data()) % 64 == 0);
+    }
+
+    // once warmed up, training steps draw all temporaries from the same block
+    ArrayXX x = ArrayXX::Random(6, 1);
+    ArrayXX y = ArrayXX::Zero(4, 1);
+    y(1, 0) = 1.f;
+    auto net = nn::Net::make(x, y, {8}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    net->accumulateGradient(x, y);
+    g_arena.reset();
+    const auto globalCapacity = g_arena.capacity();
+    net->accumulateGradient(x, y);
+    TUW_CHECK(g_arena.nBlocks() == 1);
+    TUW_CHECK(g_arena.capacity() == globalCapacity);
+    // as do the buffers of the workspace
+    TUW_CHECK(reinterpret_cast<uintptr_t>(net->costPlan->forward().data()) % 64 == 0);
+    for (const auto& slot : net->costPlan->slots())
+        TUW_CHECK(slot.leaf || slot.fusedIndex >= 0 || slot.value % cacheLineFloats == 0);
+}
+
+void testEvalForwardReferences() {
+    std::cout << "testEvalForwardReferences()" << std::endl;
+
+    auto x = Variable::make(ArrayXX::Random(5, 3));
+    auto f = exp(x);
+    const ArrayXX& value = f->evalForward();
+    const ArrayXX* data = &value;
+    TUW_CHECK(&f->evalForward() == data);
+    TUW_CHECK(&x->evalForward() == &x->value());
+
+    // re-evaluation after a reset reuses the cached buffer
+    const float* buffer = value.data();
+    x->valueForWrite() *= 2.f;
+    f->reset();
+    TUW_CHECK(f->evalForward().data() == buffer);
+    TUW_CHECK((value - x->value().exp()).abs().maxCoeff() < 0.0001f);
+
+    reduceSum(f)->differentiateBackward();
+    const ArrayXX& gradient = x->gradient();
+    TUW_CHECK((gradient - x->value().exp()).abs().maxCoeff() < 0.0001f);
+    x->resetGradient();
+    TUW_CHECK(&x->gradient() == &gradient);
+}
+
+void testFusion() {
+    std::cout << "testFusion()" << std::endl;
+
+    // several tiles per fused step
+    auto x = Variable::make(ArrayXX::Random(700, 3));
+    auto truth = Constant::make((ArrayXX::Random(700, 3) + 1.f) * 0.5f);
+    auto f = nn::crossEntropy2(nn::sigmoid(x), truth);
+
+    float expressionLoss = f->evalForward()(0);
+    f->differentiateBackward();
+    ArrayXX expressionGradient = x->gradient();
+    x->resetGradient();
+
+    auto plan = Plan::make(f);
+    size_t largestStep = 0;
+    for (const auto& step : plan->steps())
+        largestStep = std::max(largestStep, size_t(step.end - step.begin));
+    TUW_CHECK(largestStep >= 4);
+    TUW_CHECK(plan->steps().size() < plan->instructions().size());
+
+    float planLoss = plan->forward()(0);
+    plan->backward();
+    TUW_CHECK(std::abs(planLoss - expressionLoss) < std::abs(expressionLoss) * 0.00001f);
+    TUW_CHECK((x->gradient() - expressionGradient).abs().maxCoeff() < 0.00001f);
+}
+
+void testCommonSubexpressions() {
+    std::cout << "testCommonSubexpressions()" << std::endl;
+
+    auto x = Variable::make(ArrayXX::Random(5, 1));
+    auto y = Variable::make(ArrayXX::Random(5, 1));
+    auto pinned = Constant::make(5, 1, 1);
+    pinned->setMutable(true);
+    auto f = reduceSum(cwisemul(exp(x), exp(x)) + cwisemul(x + y, y + x) + nn::sigmoid(x) + nn::sigmoid(x) + pinned + Constant::make(5, 1, 1));
+    auto g = passes::eliminateCommonSubexpressions(f);
+
+    // exp(x), x + y and sigmoid(x) are computed once, all ones constants except the pinned one are merged
+    TUW_CHECK(g->tape().size() < f->tape().size());
+    size_t fExps = 0;
+    size_t gExps = 0;
+    size_t gLeaves = 0;
+    for (auto node : f->tape())
+        fExps += node->op() == &operators::g_exp;
+    for (auto node : g->tape()) {
+        gExps += node->op() == &operators::g_exp;
+        gLeaves += !node->op();
+    }
+    TUW_CHECK(fExps == 4);
+    TUW_CHECK(gExps == 2);
+    // x, y, pinned, the other 5x1 ones constant and the ones and zeros of sigmoid
+    TUW_CHECK(gLeaves == 6);
+
+    TUW_CHECK(std::abs(f->evalForward()(0) - g->evalForward()(0)) < 0.0001f);
+    f->differentiateBackward();
+    ArrayXX fGradient = x->gradient();
+    x->resetGradient();
+    g->differentiateBackward();
+    TUW_CHECK((x->gradient() - fGradient).abs().maxCoeff() < 0.0001f);
+}
+
+void testConstantFolding() {
+    std::cout << "testConstantFolding()" << std::endl;
+
+    // scalar operands are broadcast, their gradient sums up over all elements
+    auto x = Variable::make(ArrayXX::Random(700, 3));
+    auto s = Variable::make(0.5f);
+    auto f = reduceSum(cwisediv(cwisemul(Constant::make(2), x) - s, s + exp(x)));
+    auto full = Constant::make(700, 3, 0.5f);
+    auto reference = reduceSum(cwisediv(cwisemul(Constant::make(700, 3, 2), x) - full, full + exp(x)));
+    TUW_CHECK(std::abs(f->evalForward()(0) - reference->evalForward()(0)) < 0.001f);
+    f->differentiateBackward();
+    ArrayXX dx = x->gradient();
+    const float ds = s->gradient()(0);
+    const ArrayXX expected = -1.f / (0.5f + x->value().exp()) - (2 * x->value() - 0.5f) / (0.5f + x->value().exp()).square();
+    TUW_CHECK(std::abs(ds - expected.sum()) < 0.01f);
+
+    // the plan fuses the broadcasting instructions and agrees with the expression graph
+    x->resetGradient();
+    s->resetGradient();
+    auto plan = Plan::make(f);
+    TUW_CHECK(std::abs(plan->forward()(0) - f->evalForward()(0)) < 0.001f);
+    plan->backward(ArrayXX::Constant(1, 1, 1));
+    TUW_CHECK((x->gradient() - dx).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK(std::abs(s->gradient()(0) - ds) < 0.01f);
+
+    // exp(c) * log(c) depends on constants only and becomes a single constant
+    auto y = Variable::make(ArrayXX::Random(3, 1));
+    auto g = reduceSum(cwisemul(y, cwisemul(exp(Constant::make(3, 1, 2)), log(Constant::make(3, 1, 2)))));
+    auto folded = passes::foldConstants(g);
+    size_t ops = 0;
+    for (auto node : folded->tape())
+        ops += node->op() != nullptr;
+    TUW_CHECK(ops == 2);
+    TUW_CHECK(std::abs(folded->evalForward()(0) - g->evalForward()(0)) < 0.001f);
+
+    // mutable constants may change and are not folded, other references to a constant don't matter
+    auto c = Constant::make(3, 1, 2);
+    TUW_CHECK(passes::foldConstants(reduceSum(exp(c)))->tape().size() == 2);
+    c->setMutable(true);
+    auto pinned = passes::foldConstants(reduceSum(exp(c)));
+    TUW_CHECK(pinned->tape().size() == 3);
+    auto d = Constant::make(3, 1, 2);
+    TUW_CHECK(passes::foldConstants(reduceSum(exp(d)), {d.get()})->tape().size() == 3);
+}
+
+
+void testIncrementalEvaluation() {
+    std::cout << "testIncrementalEvaluation()" << std::endl;
+
+    auto x = Variable::make(ArrayXX::Random(5, 1));
+    auto y = Variable::make(ArrayXX::Random(5, 1));
+    auto expX = exp(x);
+    auto yy = cwisemul(y, y);
+    auto f = reduceSum(expX + yy);
+    f->evalForward();
+    const unsigned expXVersion = expX->version();
+    const unsigned yyVersion = yy->version();
+
+    // nothing changed, nothing is evaluated
+    f->evalForward();
+    TUW_CHECK(expX->version() == expXVersion);
+    TUW_CHECK(yy->version() == yyVersion);
+
+    // reading is not a change
+    const unsigned xVersion = x->version();
+    x->value();
+    TUW_CHECK(x->version() == xVersion);
+
+    // only the path from x to the root is evaluated again
+    x->valueForWrite() *= 2.f;
+    const float expected = x->evalForward().exp().sum() + y->evalForward().square().sum();
+    TUW_CHECK(std::abs(f->evalForward()(0) - expected) < 0.0001f);
+    TUW_CHECK(expX->version() == expXVersion + 1);
+    TUW_CHECK(yy->version() == yyVersion);
+
+    // assigning the same value again is not a change
+    const unsigned yVersion = y->version();
+    y->setValue(ArrayXX(y->evalForward()));
+    TUW_CHECK(y->version() == yVersion);
+    y->setValue(ArrayXX::Zero(5, 1));
+    TUW_CHECK(y->version() == yVersion + 1);
+    TUW_CHECK(std::abs(f->evalForward()(0) - x->evalForward().exp().sum()) < 0.0001f);
+    TUW_CHECK(expX->version() == expXVersion + 1);
+}
+
+
+void testGradientPruning() {
+    std::cout << "testGradientPruning()" << std::endl;
+
+    auto W = Variable::make(ArrayXX::Random(4, 5));
+    auto x = Variable::make(ArrayXX::Random(5, 1));
+    x->setRequiresGradient(false);
+    auto expX = exp(x);
+    auto f = reduceSum(cwisemul(W * x, W * expX));
+    f->differentiateBackward();
+    TUW_CHECK(f->requiresGradient());
+    TUW_CHECK(!expX->requiresGradient());
+    TUW_CHECK((x->gradient() == 0).all());
+    const ArrayXX Wx = W->value().matrix() * x->value().matrix();
+    const ArrayXX WexpX = W->value().matrix() * x->value().exp().matrix();
+    const ArrayXX expected = (WexpX.matrix() * x->value().matrix().transpose() + Wx.matrix() * x->value().exp().matrix().transpose()).array();
+    TUW_CHECK((W->gradient() - expected).abs().maxCoeff() < 0.0001f);
+
+    // the plan keeps no adjoint for exp(x) and agrees with the expression graph
+    W->resetGradient();
+    auto plan = Plan::make(f);
+    plan->forward();
+    plan->backward();
+    TUW_CHECK((x->gradient() == 0).all());
+    TUW_CHECK((W->gradient() - expected).abs().maxCoeff() < 0.0001f);
+    size_t withoutAdjoint = 0;
+    for (const auto& slot : plan->slots())
+        withoutAdjoint += !slot.leaf && slot.adjoint == -1;
+    TUW_CHECK(withoutAdjoint == 1);
+}
+
+
+void testParallelPlan() {
+    std::cout << "testParallelPlan()" << std::endl;
+
+    // an ensemble of independent heads, each with its own weights
+    auto x = Constant::make(ArrayXX::Random(20, 1));
+    std::vector<VariablePtr> weights;
+    ExpressionPtr f;
+    for (int i = 0; i < 6; ++i) {
+        weights.push_back(Variable::make(ArrayXX::Random(30, 20)));
+        auto head = reduceSum(nn::sigmoid(relu(weights.back() * x)));
+        f = f ? f + head : head;
+    }
+    auto plan = Plan::make(f);
+    const float expected = plan->forward()(0);
+    plan->backward();
+    std::vector<ArrayXX> gradients;
+    for (const auto& W : weights) {
+        gradients.push_back(W->gradient());
+        W->resetGradient();
+    }
+
+    ThreadPool pool(4);
+    for (int run = 0; run < 20; ++run) {
+        TUW_CHECK(std::abs(plan->forward(pool)(0) - expected) < 0.0001f);
+        plan->backward(pool);
+        for (size_t i = 0; i < weights.size(); ++i) {
+            TUW_CHECK((weights[i]->gradient() - gradients[i]).abs().maxCoeff() < 0.0001f);
+            weights[i]->resetGradient();
+        }
+    }
+}
+
+
+void testCheckpointing() {
+    std::cout << "testCheckpointing()" << std::endl;
+
+    auto build = [](const ExpressionPtr& input, const std::vector<VariablePtr>& weights, std::vector<ExpressionPtr>* layers) {
+        ExpressionPtr out = input;
+        for (const auto& W : weights) {
+            out = nn::sigmoid(relu(W * out));
+            layers->push_back(out);
+        }
+        return reduceSum(out);
+    };
+    auto x = Constant::make(ArrayXX::Random(10, 1));
+    std::vector<VariablePtr> weights;
+    for (int i = 0; i < 4; ++i)
+        weights.push_back(Variable::make(ArrayXX::Random(10, 10)));
+    std::vector<ExpressionPtr> layers;
+    auto f = build(x, weights, &layers);
+    const float expected = f->evalForward()(0);
+    f->differentiateBackward();
+    std::vector<ArrayXX> gradients;
+    for (const auto& W : weights) {
+        gradients.push_back(W->gradient());
+        W->resetGradient();
+    }
+
+    // same graph, but only every second layer output is kept
+    std::vector<ExpressionPtr> checkpointedLayers;
+    auto g = build(x, weights, &checkpointedLayers);
+    g->setCheckpointing(true);
+    checkpointedLayers[1]->setCheckpoint(true);
+    TUW_CHECK(std::abs(g->evalForward()(0) - expected) < 0.0001f);
+    size_t kept = 0;
+    for (auto node : g->tape())
+        kept += node->op() && !node->isReleased();
+    TUW_CHECK(kept == 2);
+    TUW_CHECK(!checkpointedLayers[1]->isReleased());
+
+    g->differentiateBackward();
+    for (size_t i = 0; i < weights.size(); ++i)
+        TUW_CHECK((weights[i]->gradient() - gradients[i]).abs().maxCoeff() < 0.0001f);
+    kept = 0;
+    for (auto node : g->tape())
+        kept += node->op() && !node->isReleased();
+    TUW_CHECK(kept == 2);
+
+    // nothing changed, released values stay released until something asks for them
+    TUW_CHECK(std::abs(g->evalForward()(0) - expected) < 0.0001f);
+    TUW_CHECK(checkpointedLayers[0]->isReleased());
+    TUW_CHECK((checkpointedLayers[0]->evalForward() - layers[0]->evalForward()).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK(!checkpointedLayers[0]->isReleased());
+
+    // a checkpointing net trains through the graph, same gradients as the plan but only the layer outputs kept
+    auto net = nn::Net::make(ArrayXX::Random(6, 1), ArrayXX::Zero(3, 1), {5, 4}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    const ArrayXX input = ArrayXX::Random(6, 1);
+    ArrayXX target = ArrayXX::Zero(3, 1);
+    target(1) = 1;
+    const float planLoss = net->accumulateGradient(input, target);
+    std::vector<ArrayXX> planGradients;
+    for (const auto& layer : net->layers) {
+        planGradients.push_back(layer->W->gradient());
+        layer->resetGradient();
+    }
+    net->setCheckpointing(true);
+    TUW_CHECK(std::abs(net->accumulateGradient(input, target) - planLoss) < 0.00001f);
+    for (size_t i = 0; i < net->layers.size(); ++i)
+        TUW_CHECK((net->layers[i]->W->gradient() - planGradients[i]).abs().maxCoeff() < 0.00001f);
+    kept = 0;
+    for (auto node : net->costOutExpr->tape())
+        kept += node->op() && !node->isReleased();
+    TUW_CHECK(kept == net->layers.size() + 1);
+}
+
+
+void testForwardMode() {
+    std::cout << "testForwardMode()" << std::endl;
+
+    // one forward sweep gives the directional derivative of all outputs
+    auto W = Variable::make(ArrayXX::Random(6, 4));
+    auto x = Variable::make(ArrayXX::Random(4, 1));
+    auto s = Variable::make(0.5f);
+    auto f = nn::softmax(cwisediv(relu(W * x), s + exp(W * x)));
+    const ArrayXX v = ArrayXX::Random(6, 4);
+    W->setTangent(v);
+    auto dual = f->evalForwardWithTangent();
+    const ArrayXX value = dual.value;
+    const ArrayXX tangent = dual.tangent;
+
+    // central differences
+    const float h = 0.001f;
+    const ArrayXX w = W->evalForward();
+    W->setValue(w + h * v);
+    const ArrayXX plus = f->evalForward();
+    W->setValue(w - h * v);
+    const ArrayXX minus = f->evalForward();
+    W->setValue(w);
+    TUW_CHECK((f->evalForward() - value).abs().maxCoeff() < 0.00001f);
+    TUW_CHECK(((plus - minus) / (2 * h) - tangent).abs().maxCoeff() < 0.001f);
+
+    // for a scalar function, forward and reverse mode agree: <gradient, v> = jvp
+    W->clearTangent();
+    x->setTangent(ArrayXX::Ones(4, 1));
+    s->setTangent(ArrayXX::Constant(1, 1, 2));
+    auto loss = reduceProd(reduceSum(cwisemul(f, f)) + Constant::make(1));
+    const float jvp = loss->evalForwardWithTangent().tangent(0);
+    loss->differentiateBackward();
+    TUW_CHECK(std::abs(jvp - (x->gradient().sum() + 2 * s->gradient()(0))) < 0.0001f);
+    x->clearTangent();
+    s->clearTangent();
+    TUW_CHECK((loss->evalForwardWithTangent().tangent == 0).all());
+}
+
+
+void testHessianVectorProduct() {
+    std::cout << "testHessianVectorProduct()" << std::endl;
+
+    // compared to central differences of the gradient along v
+    auto net = nn::Net::make(ArrayXX::Random(5, 1), ArrayXX::Zero(3, 1), {4}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    ArrayXX input = ArrayXX::Random(5, 1);
+    ArrayXX target = ArrayXX::Zero(3, 1);
+    target(1) = 1;
+    const auto params = net->parameters();
+    std::vector<ArrayXX> v;
+    for (const auto& param : params)
+        v.push_back(ArrayXX::Random(param->rows(), param->cols()));
+    const auto products = net->hessianVectorProduct(input, target, v);
+    TUW_CHECK(products.size() == params.size());
+
+    auto gradientAt = [&](float h) {
+        std::vector<ArrayXX> original;
+        for (size_t i = 0; i < params.size(); ++i) {
+            original.push_back(params[i]->evalForward());
+            params[i]->valueForWrite() += h * v[i];
+        }
+        net->resetGradient();
+        net->loss(input, target);
+        net->costOutExpr->differentiateBackward();
+        std::vector<ArrayXX> gradients;
+        for (size_t i = 0; i < params.size(); ++i) {
+            gradients.push_back(params[i]->gradient());
+            params[i]->setValue(original[i]);
+        }
+        return gradients;
+    };
+    const float h = 0.001f;
+    const auto plus = gradientAt(h);
+    const auto minus = gradientAt(-h);
+    for (size_t i = 0; i < params.size(); ++i)
+        TUW_CHECK(((plus[i] - minus[i]) / (2 * h) - products[i]).abs().maxCoeff() < 0.01f);
+
+    // gradients are left alone
+    net->resetGradient();
+    net->hessianVectorProduct(input, target, v);
+    for (const auto& param : params)
+        TUW_CHECK((param->gradient() == 0).all());
+
+    // with checkpointing, only the layer outputs are kept by the forward and the reverse sweep
+    auto kept = [&]() {
+        size_t n = 0;
+        for (auto node : net->costOutExpr->tape())
+            n += node->op() && !node->isReleased();
+        return n;
+    };
+    net->setCheckpointing(true);
+    params[0]->setTangent(v[0]);
+    net->costOutExpr->evalForwardWithTangent();
+    params[0]->clearTangent();
+    TUW_CHECK(kept() == net->layers.size() + 1);
+    const auto checkpointedProducts = net->hessianVectorProduct(input, target, v);
+    for (size_t i = 0; i < params.size(); ++i)
+        TUW_CHECK((checkpointedProducts[i] - products[i]).abs().maxCoeff() < 0.00001f);
+    TUW_CHECK(kept() == net->layers.size() + 1);
+
+    // operands that appear more than once: (x - x) x x is 0, x / x x x is x^2
+    auto x = Variable::make(ArrayXX::Random(3, 1) + 2.f);
+    const ArrayXX u = ArrayXX::Random(3, 1);
+    auto zero = reduceSum(cwisemul(cwisemul(x - x, x), x));
+    TUW_CHECK((hvp(zero, {x}, {u})[0]).abs().maxCoeff() < 0.00001f);
+    auto square = reduceSum(cwisemul(cwisemul(cwisediv(x, x), x), x));
+    TUW_CHECK((hvp(square, {x}, {u})[0] - 2.f * u).abs().maxCoeff() < 0.0001f);
+}
+
+
+void testInferencePlan() {
+    std::cout << "testInferencePlan()" << std::endl;
+
+    auto net = nn::Net::make(ArrayXX::Random(20, 1), ArrayXX::Zero(3, 1), {30, 30, 30}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    const ArrayXX input = ArrayXX::Random(20, 1);
+    const ArrayXX output = net->output(input);
+    net->input->setValue(input);
+    TUW_CHECK((output - net->outExpr->evalForward()).abs().maxCoeff() < 0.00001f);
+
+    // outputs belong to the caller, later calls don't change them
+    auto first = net->output(input);
+    net->output(ArrayXX::Random(20, 1));
+    TUW_CHECK((first - output).abs().maxCoeff() < 0.00001f);
+
+    // no adjoints, and buffers of a chain are reused right away
+    auto training = Plan::make(net->outExpr);
+    TUW_CHECK(net->outputPlan->workspaceSize() < training->workspaceSize() / 2);
+    for (const auto& slot : net->outputPlan->slots())
+        TUW_CHECK(slot.adjoint == -1);
+}
+
+
+void testSerialization() {
+    std::cout << "testSerialization()" << std::endl;
+
+    auto net = nn::Net::make(ArrayXX::Random(6, 1), ArrayXX::Zero(3, 1), {5, 4}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    const ArrayXX input = ArrayXX::Random(6, 1);
+    ArrayXX target = ArrayXX::Zero(3, 1);
+    target(2) = 1;
+    net->learn(input, target);
+    const QString path = "testSerialization.tuwg";
+    TUW_CHECK(net->save(path));
+
+    auto loaded = nn::Net::load(path);
+    TUW_CHECK(loaded);
+    TUW_CHECK(loaded->layers.size() == net->layers.size());
+    TUW_CHECK(loaded->learningRate == net->learningRate);
+    TUW_CHECK((loaded->layers[1]->W->evalForward() == net->layers[1]->W->evalForward()).all());
+    TUW_CHECK((ArrayXX(loaded->output(input)) - ArrayXX(net->output(input))).abs().maxCoeff() < 0.000001f);
+    TUW_CHECK(std::abs(loaded->loss(input, target) - net->loss(input, target)) < 0.000001f);
+
+    // the loaded net trains like the original
+    TUW_CHECK(std::abs(loaded->learn(input, target) - net->learn(input, target)) < 0.000001f);
+    TUW_CHECK((loaded->layers[0]->W->evalForward() - net->layers[0]->W->evalForward()).abs().maxCoeff() < 0.000001f);
+
+    // checkpointing survives the round trip, with the layer outputs as checkpoints
+    TUW_CHECK(!loaded->checkpointing);
+    net->setCheckpointing(true);
+    TUW_CHECK(net->save(path));
+    loaded = nn::Net::load(path);
+    TUW_CHECK(loaded && loaded->checkpointing);
+    for (const auto& layer : loaded->layers)
+        TUW_CHECK(layer->out->isCheckpoint());
+    TUW_CHECK(std::abs(loaded->learn(input, target) - net->learn(input, target)) < 0.000001f);
+    size_t kept = 0;
+    for (auto node : loaded->costOutExpr->tape())
+        kept += node->op() && !node->isReleased();
+    TUW_CHECK(kept == loaded->layers.size() + 1);
+
+    // files of another version are rejected
+    std::FILE* file = std::fopen("testSerialization.tuwg", "r+b");
+    const uint32_t otherVersion = 1;
+    TUW_CHECK(file && std::fseek(file, 4, SEEK_SET) == 0 && std::fwrite(&otherVersion, sizeof(otherVersion), 1, file) == 1);
+    if (file)
+        std::fclose(file);
+    TUW_CHECK(!nn::Net::load(path));
+
+    // metadata, and corrupt files: x, exp and reduceSum are the nodes, a header of 40 bytes and node
+    // records of 32 bytes come first, then the root record
+    auto x = Variable::make(ArrayXX::Random(2, 1));
+    auto f = reduceSum(exp(x));
+    TUW_CHECK(serialization::save(path, {{"f", f}}, {{"answer", 42.f}}));
+    serialization::Metadata metadata;
+    TUW_CHECK(serialization::load(path, &metadata).size() == 1);
+    TUW_CHECK(metadata.size() == 1 && metadata[0].first == "answer" && metadata[0].second == 42.f);
+    auto corrupted = [&](long offset, const void* bytes, size_t size) {
+        serialization::save(path, {{"f", f}});
+        std::FILE* file = std::fopen("testSerialization.tuwg", "r+b");
+        TUW_CHECK(file && std::fseek(file, offset, SEEK_SET) == 0 && std::fwrite(bytes, size, 1, file) == 1);
+        if (file)
+            std::fclose(file);
+        return serialization::load(path).empty();
+    };
+    const uint8_t unknownKind = 7;
+    TUW_CHECK(corrupted(40, &unknownKind, sizeof(unknownKind)));
+    // offsets that wrap around
+    const uint64_t dataOffset = ~uint64_t(0) - 15;
+    TUW_CHECK(corrupted(40 + 24, &dataOffset, sizeof(dataOffset)));
+    const uint32_t rootNode = 3;
+    TUW_CHECK(corrupted(40 + 3 * 32, &rootNode, sizeof(rootNode)));
+    std::remove("testSerialization.tuwg");
+
+    TUW_CHECK(!nn::Net::load("doesNotExist.tuwg"));
+}
+
+
+void testFixedNet() {
+    std::cout << "testFixedNet()" << std::endl;
+
+    auto net = nn::Net::make(ArrayXX::Random(6, 1), ArrayXX::Zero(3, 1), {5, 4}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    std::unique_ptr<nn::FixedNet<6, 5, 4, 3>> fixed(new nn::FixedNet<6, 5, 4, 3>());
+    fixed->copyFrom(*net);
+    const ArrayXX input = ArrayXX::Random(6, 1);
+    ArrayXX target = ArrayXX::Zero(3, 1);
+    target(1) = 1;
+    const Eigen::VectorXf in = input.matrix();
+    const Eigen::VectorXf t = target.matrix();
+
+    TUW_CHECK((fixed->output(in).array() - ArrayXX(net->output(input))).abs().maxCoeff() < 0.00001f);
+    TUW_CHECK(std::abs(fixed->loss(in, t) - net->loss(input, target)) < 0.00001f);
+
+    // same gradients, and the same weights after a few steps
+    net->resetGradient();
+    fixed->resetGradient();
+    TUW_CHECK(std::abs(fixed->accumulateGradient(in, t) - net->accumulateGradient(input, target)) < 0.00001f);
+    const auto& first = fixed->layers();
+    TUW_CHECK((first.gradW.map().array() - net->layers[0]->W->gradient()).abs().maxCoeff() < 0.00001f);
+    TUW_CHECK((first.next.gradb.array() - net->layers[1]->b->gradient()).abs().maxCoeff() < 0.00001f);
+    TUW_CHECK((first.next.next.gradW.map().array() - net->layers[2]->W->gradient()).abs().maxCoeff() < 0.00001f);
+    for (int i = 0; i < 5; ++i)
+        TUW_CHECK(std::abs(fixed->learn(in, t) - net->learn(input, target)) < 0.0001f);
+    TUW_CHECK((first.W.map().array() - net->layers[0]->W->evalForward()).abs().maxCoeff() < 0.0001f);
+}
+
+
+void testCodeGeneration() {
+    std::cout << "testCodeGeneration()" << std::endl;
+
+    auto x = Constant::make(ArrayXX::Random(3, 1));
+    auto W = Variable::make(ArrayXX::Random(2, 3));
+    auto y = relu(W * x) + Constant::make(ArrayXX::Random(2, 1));
+    auto cost = reduceSum(cwisemul(y, y));
+    const std::string code = codegen::generate("model", {{"y", y}, {"cost", cost}}, {{"x", x}, {"W", W}});
+
+    TUW_CHECK(code.find("namespace model {") != std::string::npos);
+    TUW_CHECK(code.find("inline void y(const float* x, const float* W, float* result, float* workspace)") != std::string::npos);
+    TUW_CHECK(code.find("inline float costGradient(const float* x, const float* W, float* d_W, float* workspace)") != std::string::npos);
+    // y is not a scalar, no gradient
+    TUW_CHECK(code.find("yGradient") == std::string::npos);
+    // shapes are constants, the leaf that is not an input is baked in
+    TUW_CHECK(code.find("Eigen::Map<const Eigen::Array<float, 2, 3>>") != std::string::npos);
+    TUW_CHECK(code.find("const float c0[] = {") != std::string::npos);
+
+    auto net = nn::Net::make(ArrayXX::Random(6, 1), ArrayXX::Zero(3, 1), {5}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    TUW_CHECK(net->generateCode("testCodeGeneration.h", "net"));
+    std::remove("testCodeGeneration.h");
+
+    // generatedNet.h is the code of a net of this shape, with the weights as arguments. it has to be what the
+    // generator produces now, regenerate it with Net::generateCode(path, "generatedNet") after changing the generator.
+    auto shaped = nn::Net::make(ArrayXX::Random(6, 1), ArrayXX::Zero(3, 1), {5, 4}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    auto read = [](const char* path) {
+        std::ifstream file(path, std::ios::binary);
+        std::stringstream content;
+        content << file.rdbuf();
+        return content.str();
+    };
+    TUW_CHECK(shaped->generateCode("testCodeGeneration.h", "generatedNet"));
+    const std::string generated = read("testCodeGeneration.h");
+    std::remove("testCodeGeneration.h");
+    TUW_CHECK(!generated.empty() && generated == read(SOURCE_DIR "/generatedNet.h"));
+    const ArrayXX input = ArrayXX::Random(6, 1);
+    ArrayXX target = ArrayXX::Zero(3, 1);
+    target(1) = 1;
+    const auto& layers = shaped->layers;
+    std::vector<float> workspace(generatedNet::workspaceSize);
+    ArrayXX output(3, 1);
+    generatedNet::out(input.data(), target.data(), layers[0]->W->value().data(), layers[0]->b->value().data(),
+            layers[1]->W->value().data(), layers[1]->b->value().data(), layers[2]->W->value().data(), layers[2]->b->value().data(),
+            output.data(), workspace.data());
+    TUW_CHECK((output - ArrayXX(shaped->output(input))).abs().maxCoeff() < 0.00001f);
+
+    std::vector<ArrayXX> gradients;
+    for (const auto& layer : layers) {
+        gradients.push_back(ArrayXX::Zero(layer->W->rows(), layer->W->cols()));
+        gradients.push_back(ArrayXX::Zero(layer->b->rows(), layer->b->cols()));
+    }
+    const float generatedCost = generatedNet::costGradient(input.data(), target.data(), layers[0]->W->value().data(), layers[0]->b->value().data(),
+            layers[1]->W->value().data(), layers[1]->b->value().data(), layers[2]->W->value().data(), layers[2]->b->value().data(),
+            gradients[0].data(), gradients[1].data(), gradients[2].data(), gradients[3].data(), gradients[4].data(), gradients[5].data(),
+            workspace.data());
+    shaped->resetGradient();
+    TUW_CHECK(std::abs(generatedCost - shaped->accumulateGradient(input, target)) < 0.00001f);
+    for (size_t i = 0; i < layers.size(); ++i) {
+        TUW_CHECK((gradients[2 * i] - layers[i]->W->gradient()).abs().maxCoeff() < 0.00001f);
+        TUW_CHECK((gradients[2 * i + 1] - layers[i]->b->gradient()).abs().maxCoeff() < 0.00001f);
+    }
+}
+
+void testNaryNodes() {
+    std::cout << "testNaryNodes()" << std::endl;
+
+    // unary nodes have a single operand, no placeholder
+    auto x = Variable::make(ArrayXX::Random(4, 1));
+    auto e = exp(x);
+    TUW_CHECK(e->operands().size() == 1);
+    TUW_CHECK(reduceSum(e)->tape().size() == 3);
+
+    // a variadic sum agrees with a chain of binary additions, including a broadcast scalar
+    auto y = Variable::make(ArrayXX::Random(4, 1));
+    auto z = Variable::make(ArrayXX::Random(4, 1));
+    auto s = Variable::make(0.5f);
+    auto f = reduceSum(cwisemul(sum({x, e, cwisemul(y, z), s}), y));
+    auto g = reduceSum(cwisemul(((x + e) + cwisemul(y, z)) + s, y));
+    TUW_CHECK(f->tape().size() < g->tape().size());
+    TUW_CHECK(std::abs(f->evalForward()(0) - g->evalForward()(0)) < 0.0001f);
+    g->differentiateBackward();
+    const ArrayXX gx = x->gradient(), gy = y->gradient(), gz = z->gradient(), gs = s->gradient();
+    for (auto v : {x, y, z, s})
+        v->resetGradient();
+    f->differentiateBackward();
+    TUW_CHECK((x->gradient() - gx).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((y->gradient() - gy).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((z->gradient() - gz).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((s->gradient() - gs).abs().maxCoeff() < 0.0001f);
+
+    // the plan runs it as well
+    for (auto v : {x, y, z, s})
+        v->resetGradient();
+    auto plan = Plan::make(f);
+    TUW_CHECK(std::abs(plan->forward()(0) - g->evalForward()(0)) < 0.0001f);
+    plan->backward();
+    TUW_CHECK((x->gradient() - gx).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((s->gradient() - gs).abs().maxCoeff() < 0.0001f);
+
+    // forward mode and second order
+    z->setTangent(ArrayXX::Ones(4, 1));
+    TUW_CHECK(std::abs(f->evalForwardWithTangent().tangent(0) - gz.sum()) < 0.0001f);
+    z->clearTangent();
+    const ArrayXX v = ArrayXX::Random(4, 1);
+    const auto hf = hvp(f, {z}, {v});
+    const auto hg = hvp(g, {z}, {v});
+    TUW_CHECK((hf[0] - hg[0]).abs().maxCoeff() < 0.0001f);
+
+    // sums survive saving and loading
+    const QString path = "testNaryNodes.tuwg";
+    TUW_CHECK(serialization::save(path, {{"f", f}}));
+    auto loaded = serialization::load(path);
+    TUW_CHECK(loaded.size() == 1);
+    TUW_CHECK(loaded[0].second->tape().size() == f->tape().size());
+    TUW_CHECK(std::abs(loaded[0].second->evalForward()(0) - f->evalForward()(0)) < 0.0001f);
+    std::remove("testNaryNodes.tuwg");
+
+    TUW_CHECK(sum({x}) == x);
+}
+
+void testBroadcasting() {
+    std::cout << "testBroadcasting()" << std::endl;
+
+    // columns and rows broadcast like repeating them with an outer product of ones
+    auto m = Variable::make(ArrayXX::Random(3, 4) + 2);
+    auto column = Variable::make(ArrayXX::Random(3, 1) + 2);
+    auto row = Variable::make(ArrayXX::Random(1, 4) + 2);
+    auto w = Constant::make(ArrayXX::Random(3, 4));
+    auto columns = column * Constant::make(1, 4, 1);
+    auto rows = Constant::make(3, 1, 1) * row;
+    auto f = reduceSum(cwisemul(w, cwisediv(cwisemul(m - column, row + m), column) + cwisediv(row, m) + column));
+    auto g = reduceSum(cwisemul(w, cwisediv(cwisemul(m - columns, rows + m), columns) + cwisediv(rows, m) + columns));
+    TUW_CHECK(f->size() == Size(1, 1));
+    TUW_CHECK(std::abs(f->evalForward()(0) - g->evalForward()(0)) < 0.0001f);
+
+    g->differentiateBackward();
+    const ArrayXX gm = m->gradient(), gColumn = column->gradient(), gRow = row->gradient();
+    for (auto v : {m, column, row})
+        v->resetGradient();
+    f->differentiateBackward();
+    TUW_CHECK((m->gradient() - gm).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((column->gradient() - gColumn).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((row->gradient() - gRow).abs().maxCoeff() < 0.0001f);
+
+    // the plan runs broadcasting instructions unfused
+    for (auto v : {m, column, row})
+        v->resetGradient();
+    auto plan = Plan::make(f);
+    TUW_CHECK(std::abs(plan->forward()(0) - g->evalForward()(0)) < 0.0001f);
+    plan->backward();
+    TUW_CHECK((column->gradient() - gColumn).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((row->gradient() - gRow).abs().maxCoeff() < 0.0001f);
+
+    // forward mode
+    row->setTangent(ArrayXX::Ones(1, 4));
+    TUW_CHECK(std::abs(f->evalForwardWithTangent().tangent(0) - gRow.sum()) < 0.001f);
+    row->clearTangent();
+
+    // a column and a row broadcast against each other
+    auto outer = column + row;
+    TUW_CHECK(outer->size() == Size(3, 4));
+    TUW_CHECK(((outer->evalForward() - (columns + rows)->evalForward()).abs() < 0.00001f).all());
+
+    // the bias of a layer is added to every sample of a batch
+    auto batch = Constant::make(ArrayXX::Random(5, 8));
+    auto layer = nn::Layer::make(batch, 4, [](ExpressionPtr x) { return x; });
+    layer->b->setValue(ArrayXX::Random(4, 1));
+    const ArrayXX expected = (layer->W->value().matrix() * batch->value().matrix()).array().colwise() - layer->b->value().col(0);
+    TUW_CHECK((layer->out->evalForward() - expected).abs().maxCoeff() < 0.0001f);
+}
+
+void testInPlace() {
+    std::cout << "testInPlace()" << std::endl;
+
+    // steps writing their result over an input
+    auto inPlaceSteps = [](const Plan& plan) {
+        int count = 0;
+        for (const auto& step : plan.steps()) {
+            const auto& out = plan.slots()[size_t(plan.instructions()[size_t(step.end - 1)].out)];
+            for (int input : step.inputs)
+                count += !plan.slots()[size_t(input)].leaf && plan.slots()[size_t(input)].value == out.value;
+        }
+        return count;
+    };
+
+    // the vjp of exp reads its result only, so exp overwrites W * x. the result of exp is read again by
+    // the backward pass of Mul and keeps its buffer.
+    auto W = Variable::make(ArrayXX::Random(4, 5));
+    auto x = Constant::make(ArrayXX::Random(5, 1));
+    auto e = exp(W * x);
+    auto f = reduceSum(cwisemul(e, e));
+    auto plan = Plan::make(f);
+    TUW_CHECK(inPlaceSteps(*plan) == 1);
+    for (const auto& instruction : plan->instructions()) {
+        if (instruction.op == &operators::g_exp)
+            TUW_CHECK(plan->slots()[size_t(instruction.out)].value == plan->slots()[size_t(instruction.operands[0])].value);
+    }
+    TUW_CHECK(std::abs(plan->forward()(0) - f->evalForward()(0)) < 0.0001f);
+    plan->backward();
+    const ArrayXX planGradient = W->gradient();
+    W->resetGradient();
+    f->differentiateBackward();
+    TUW_CHECK((planGradient - W->gradient()).abs().maxCoeff() < 0.0001f);
+
+    // without a backward pass, every layer of a net reuses the buffer of its matrix product
+    const ArrayXX input = ArrayXX::Random(6, 1);
+    auto net = nn::Net::make(input, ArrayXX::Zero(3, 1), {8, 8}, relu, nn::softmax, nn::crossEntropy, 0.1f);
+    TUW_CHECK(inPlaceSteps(*net->outputPlan) >= 2);
+    TUW_CHECK((ArrayXX(net->output(input)) - net->outExpr->evalForward()).abs().maxCoeff() < 0.00001f);
+}
+
+void testSimplification() {
+    std::cout << "testSimplification()" << std::endl;
+
+    auto x = Variable::make(ArrayXX::Random(3, 1));
+    auto y = Variable::make(ArrayXX::Random(3, 4));
+    TUW_CHECK(passes::simplify(reduceSum(log(exp(x))))->tape().size() == 2);
+    auto identity = Constant::make(1) * reduceSum(y);
+    TUW_CHECK(passes::simplify(identity)->tape().size() == 2);
+    auto scaled = Constant::make(1, 1, -1) * reduceSum(y);
+    TUW_CHECK(passes::simplify(scaled)->op() == &operators::g_mul);
+
+    // the patterns of nn: a bias repeated with ones, negations, scaling with a matrix product
+    auto f = Constant::make(1, 1, -1) * reduceSum(cwisemul(log(exp(y - x * Constant::make(1, 4, 1))),
+                                                           y + (Constant::make(0) - exp(Constant::make(0) - y))));
+    auto simplified = passes::simplify(f);
+    TUW_CHECK(simplified->tape().size() + 6 == f->tape().size());
+    for (auto node : simplified->tape())
+        TUW_CHECK(node->op() != &operators::g_matMul && node->op() != &operators::g_log);
+    TUW_CHECK(std::abs(simplified->evalForward()(0) - f->evalForward()(0)) < 0.0001f);
+    f->differentiateBackward();
+    const ArrayXX gx = x->gradient(), gy = y->gradient();
+    x->resetGradient();
+    y->resetGradient();
+    simplified->differentiateBackward();
+    TUW_CHECK((x->gradient() - gx).abs().maxCoeff() < 0.0001f);
+    TUW_CHECK((y->gradient() - gy).abs().maxCoeff() < 0.0001f);
+
+    // mutable constants may change
+    auto zero = Constant::make(3, 4, 0);
+    zero->setMutable(true);
+    TUW_CHECK(passes::simplify(reduceSum(zero + y))->tape().size() == 4);
+}
+
+void testMatrixChains() {
+    std::cout << "testMatrixChains()" << std::endl;
+
+    // (W2 * W1) * x needs a 100 x 100 product, W2 * (W1 * x) only matrix vector products
+    auto W1 = Variable::make(ArrayXX::Random(100, 100) * 0.1f);
+    auto W2 = Variable::make(ArrayXX::Random(100, 100) * 0.1f);
+    auto x = Constant::make(ArrayXX::Random(100, 1));
+    auto f = reduceSum(W2 * W1 * x);
+    auto reordered = passes::reorderMatrixChains(f);
+    const auto& product = reordered->operands()[0];
+    TUW_CHECK(product->operands()[0] == W2);
+    TUW_CHECK(product->operands()[1]->size() == Size(100, 1));
+    TUW_CHECK(std::abs(reordered->evalForward()(0) - f->evalForward()(0)) < 0.001f);
+    f->differentiateBackward();
+    const ArrayXX g1 = W1->gradient(), g2 = W2->gradient();
+    W1->resetGradient();
+    W2->resetGradient();
+    reordered->differentiateBackward();
+    TUW_CHECK((W1->gradient() - g1).abs().maxCoeff() < 0.001f);
+    TUW_CHECK((W2->gradient() - g2).abs().maxCoeff() < 0.001f);
+
+    // plans reorder as well, no slot holds a 100 x 100 intermediate
+    auto plan = Plan::make(f);
+    for (const auto& slot : plan->slots())
+        TUW_CHECK(slot.leaf || slot.rows * slot.cols <= 100);
+
+    // intermediate results with other uses are kept
+    auto shared = W2 * W1;
+    auto g = reduceSum(shared * x) + reduceSum(shared);
+    TUW_CHECK(passes::reorderMatrixChains(g) == g);
+}
+
 }
 
 void test()
@@ -268,4 +1204,26 @@ void test()
 //	testLossGradients(nn::softmax, nn::crossEntropy2);
 
     testSoftMax();
+    testDiamondBackward();
+    testPlan();
+    testArena();
+    testEvalForwardReferences();
+    testFusion();
+    testCommonSubexpressions();
+    testConstantFolding();
+    testIncrementalEvaluation();
+    testGradientPruning();
+    testParallelPlan();
+    testCheckpointing();
+    testForwardMode();
+    testHessianVectorProduct();
+    testInferencePlan();
+    testSerialization();
+    testFixedNet();
+    testCodeGeneration();
+    testNaryNodes();
+    testBroadcasting();
+    testInPlace();
+    testSimplification();
+    testMatrixChains();
 }
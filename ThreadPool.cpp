@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ThreadPool.h"
+
+#include <QtGlobal>
+
+ThreadPool::ThreadPool(unsigned nThreads) : m_queued(0), m_remaining(0)
+{
+    Q_ASSERT(nThreads > 0);
+    for (unsigned i = 0; i < nThreads; ++i)
+        m_queues.emplace_back(new Queue());
+    for (unsigned i = 0; i < nThreads; ++i)
+        m_threads.emplace_back(&ThreadPool::work, this, size_t(i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::run(const Graph& graph, const std::function<void(int)>& task)
+{
+    const int n = int(graph.size());
+    if (n == 0)
+        return;
+    m_graph = &graph;
+    m_task = &task;
+    m_waiting.reset(new std::atomic<int>[size_t(n)]);
+    for (int i = 0; i < n; ++i)
+        m_waiting[size_t(i)] = graph.nDependencies[size_t(i)];
+    m_remaining = n;
+
+    // the initially ready tasks are dealt out round robin, the rest is balanced by stealing
+    size_t worker = 0;
+    for (int i = 0; i < n; ++i) {
+        if (graph.nDependencies[size_t(i)] == 0) {
+            push(worker, i);
+            worker = (worker + 1) % m_queues.size();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_remaining == 0; });
+    m_graph = nullptr;
+    m_task = nullptr;
+}
+
+void ThreadPool::work(size_t worker)
+{
+    for (;;) {
+        int task;
+        if (pop(worker, &task) || steal(worker, &task)) {
+            execute(worker, task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop)
+            return;
+    }
+}
+
+void ThreadPool::push(size_t worker, int task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+        m_queues[worker]->tasks.push_back(task);
+    }
+    ++m_queued;
+    // taking the lock makes sure that no worker is between checking m_queued and going to sleep
+    { std::lock_guard<std::mutex> lock(m_mutex); }
+    m_wake.notify_one();
+}
+
+bool ThreadPool::pop(size_t worker, int* task)
+{
+    std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+    auto& tasks = m_queues[worker]->tasks;
+    if (tasks.empty())
+        return false;
+    *task = tasks.back();
+    tasks.pop_back();
+    --m_queued;
+    return true;
+}
+
+bool ThreadPool::steal(size_t worker, int* task)
+{
+    for (size_t i = 1; i < m_queues.size(); ++i) {
+        auto& victim = *m_queues[(worker + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty())
+            continue;
+        *task = victim.tasks.front();
+        victim.tasks.pop_front();
+        --m_queued;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::execute(size_t worker, int task)
+{
+    (*m_task)(task);
+    for (int dependent : m_graph->dependents[size_t(task)]) {
+        if (--m_waiting[size_t(dependent)] == 0)
+            push(worker, dependent);
+    }
+    if (--m_remaining == 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done.notify_all();
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// runs the tasks of a dependency graph on a fixed set of worker threads. every worker has its own
+// deque: tasks that become ready are pushed to the back of the deque of the worker that finished their
+// last dependency and taken from there (depth first, warm caches), idle workers steal from the front of other deques.
+class ThreadPool {
+public:
+    struct Graph {
+        std::vector<int> nDependencies;             // per task
+        std::vector<std::vector<int>> dependents;   // per task, tasks waiting for it
+        size_t size() const { return nDependencies.size(); }
+    };
+
+    explicit ThreadPool(unsigned nThreads = std::max(1u, std::thread::hardware_concurrency()));
+    ThreadPool(const ThreadPool&) = delete;
+    ~ThreadPool();
+    // blocks until all tasks are done. task is called with the index of the task, concurrently from several threads.
+    void run(const Graph& graph, const std::function<void(int)>& task);
+    unsigned nThreads() const { return unsigned(m_threads.size()); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    bool m_stop = false;
+    std::atomic<int> m_queued;
+    std::atomic<int> m_remaining;
+    std::unique_ptr<std::atomic<int>[]> m_waiting;
+    const Graph* m_graph = nullptr;
+    const std::function<void(int)>* m_task = nullptr;
+
+    void work(size_t worker);
+    void push(size_t worker, int task);
+    bool pop(size_t worker, int* task);
+    bool steal(size_t worker, int* task);
+    void execute(size_t worker, int task);
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "codegen.h"
+
+#include <cmath>
+#include <iomanip>
+#include <locale>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <QFile>
+#include <QtGlobal>
+
+#include "operators.h"
+#include "passes.h"
+
+namespace {
+std::string identifier(const std::string& name)
+{
+    std::string id = name;
+    for (auto& c : id) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            c = '_';
+    }
+    if (id.empty() || std::isdigit(static_cast<unsigned char>(id[0])))
+        id = "_" + id;
+    return id;
+}
+
+std::string literal(float value)
+{
+    if (std::isnan(value))
+        return "std::numeric_limits<float>::quiet_NaN()";
+    if (std::isinf(value))
+        return value > 0 ? "std::numeric_limits<float>::infinity()" : "-std::numeric_limits<float>::infinity()";
+    std::ostringstream s;
+    s.imbue(std::locale::classic());
+    s << std::setprecision(9) << value;
+    std::string text = s.str();
+    if (text.find_first_of(".e") == std::string::npos)
+        text += ".0";
+    return text + "f";
+}
+
+std::string arrayType(Eigen::Index rows, Eigen::Index cols)
+{
+    return "Eigen::Array<float, " + std::to_string(rows) + ", " + std::to_string(cols) + ">";
+}
+
+// an operand as seen from an element wise operation, 1x1 operands are broadcast as scalars,
+// columns and rows are repeated
+std::string operand(const std::string& name, Expression* node, Expression* consumer)
+{
+    if (node->size() == consumer->size())
+        return name;
+    if (node->rows() * node->cols() == 1)
+        return name + "(0, 0)";
+    if (node->cols() == 1)
+        return name + ".replicate<1, " + std::to_string(consumer->cols()) + ">()";
+    return name + ".replicate<" + std::to_string(consumer->rows()) + ", 1>()";
+}
+
+bool broadcast(Expression* node, Expression* consumer)
+{
+    return node->size() != consumer->size();
+}
+
+// x are the names of the operands. unary operators only look at a.
+std::string evalCode(Expression* node, const std::string& out, const std::vector<std::string>& x)
+{
+    const operators::Ptr op = node->op();
+    const std::string& a = x.front();
+    const std::string& b = x.back();
+    const std::string ea = operand(a, node->operands().front().get(), node);
+    const std::string eb = operand(b, node->operands().back().get(), node);
+    if (op == &operators::g_add)
+        return out + " = " + ea + " + " + eb + ";";
+    if (op == &operators::g_subtract)
+        return out + " = " + ea + " - " + eb + ";";
+    if (op == &operators::g_mul)
+        return out + " = " + ea + " * " + eb + ";";
+    if (op == &operators::g_div)
+        return out + " = " + ea + " / " + eb + ";";
+    if (op == &operators::g_log)
+        return out + " = " + a + ".log();";
+    if (op == &operators::g_exp)
+        return out + " = " + a + ".exp();";
+    if (op == &operators::g_normExp)
+        return out + " = (" + a + " - " + a + ".maxCoeff()).exp();";
+    if (op == &operators::g_relu)
+        return out + " = " + a + ".max(" + a + " * 0.01f);";
+    if (op == &operators::g_vvt || op == &operators::g_matMul)
+        return out + ".matrix().noalias() = " + a + ".matrix() * " + b + ".matrix();";
+    if (op == &operators::g_reduceSum)
+        return out + "(0, 0) = " + a + ".sum();";
+    if (op == &operators::g_reduceProd)
+        return out + "(0, 0) = " + a + ".prod();";
+    if (op == &operators::g_sum) {
+        std::string code = out + " = ";
+        for (size_t k = 0; k < x.size(); ++k)
+            code += (k ? " + " : "") + operand(x[k], node->operands()[k].get(), node);
+        return code + ";";
+    }
+    Q_ASSERT(false);
+    return "";
+}
+
+// adds (accumulate) or assigns the contribution of node to the adjoint of its k-th operand
+std::string vjpCode(Expression* node, int k, const std::string& target, bool accumulate,
+                    const std::vector<std::string>& x, const std::string& result, const std::string& back)
+{
+    const operators::Ptr op = node->op();
+    Expression* child = node->operands()[size_t(k)].get();
+    const bool wrtB = k == 1;
+    const std::string& a = x.front();
+    const std::string& b = x.back();
+    const std::string assign = accumulate ? " += " : " = ";
+    if (op == &operators::g_vvt || op == &operators::g_matMul) {
+        if (wrtB)
+            return target + ".matrix().noalias()" + assign + a + ".matrix().transpose() * " + back + ".matrix();";
+        return target + ".matrix().noalias()" + assign + back + ".matrix() * " + b + ".matrix().transpose();";
+    }
+    if (op == &operators::g_reduceSum)
+        return accumulate ? target + " += " + back + "(0, 0);" : target + ".setConstant(" + back + "(0, 0));";
+
+    const std::string ea = operand(a, node->operands().front().get(), node);
+    const std::string eb = operand(b, node->operands().back().get(), node);
+    std::string contribution;
+    if (op == &operators::g_add || op == &operators::g_sum)
+        contribution = back;
+    else if (op == &operators::g_subtract)
+        contribution = wrtB ? "-" + back : back;
+    else if (op == &operators::g_mul)
+        contribution = back + " * " + (wrtB ? ea : eb);
+    else if (op == &operators::g_div)
+        contribution = wrtB ? "-" + back + " * " + ea + " / (" + eb + " * " + eb + ")" : back + " / " + eb;
+    else if (op == &operators::g_log)
+        contribution = back + " / " + a;
+    else if (op == &operators::g_exp || op == &operators::g_normExp)
+        contribution = back + " * " + result;
+    else if (op == &operators::g_relu)
+        contribution = back + " * ((" + a + " > 0.f).cast<float>() * 0.99f + 0.01f)";
+    else if (op == &operators::g_reduceProd)
+        contribution = "(" + back + "(0, 0) * " + result + "(0, 0)) / " + a;
+    else
+        Q_ASSERT(false);
+
+    if (broadcast(child, node) && child->rows() * child->cols() == 1)
+        return target + "(0, 0)" + assign + "(" + contribution + ").sum();";
+    if (broadcast(child, node))
+        return target + assign + "(" + contribution + ")." + (child->cols() == 1 ? "rowwise" : "colwise") + "().sum();";
+    return target + assign + contribution + ";";
+}
+
+class Generator {
+public:
+    explicit Generator(const codegen::NamedExpressions& inputs) : m_inputs(inputs) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            Q_ASSERT(!inputs[i].second->op());
+            m_inputOf[inputs[i].second.get()] = int(i);
+        }
+    }
+    std::string function(const std::string& name, const ExpressionPtr& root, bool gradient);
+    const std::string& constants() const { return m_constants; }
+    Eigen::Index workspaceSize() const { return m_workspaceSize; }
+
+private:
+    const codegen::NamedExpressions& m_inputs;
+    std::unordered_map<Expression*, int> m_inputOf;
+    std::unordered_map<Expression*, std::string> m_baked;
+    std::string m_constants;
+    Eigen::Index m_workspaceSize = 0;
+
+    bool trainable(int input) const {
+        auto variable = std::dynamic_pointer_cast<Variable>(m_inputs[size_t(input)].second);
+        return variable && variable->requiresGradient();
+    }
+    std::string bake(Expression* leaf);
+};
+
+// leaves that are not inputs. uniform values become nullary expressions, everything else a static array.
+std::string Generator::bake(Expression* leaf)
+{
+    auto known = m_baked.find(leaf);
+    if (known != m_baked.end())
+        return known->second;
+
+    const ArrayXX& value = static_cast<const Variable*>(leaf)->value();
+    const std::string type = arrayType(value.rows(), value.cols());
+    std::string code;
+    if (value.size() > 0 && (value == value(0, 0)).all()) {
+        code = type + "::Constant(" + literal(value(0, 0)) + ")";
+    }
+    else {
+        const std::string data = "c" + std::to_string(m_baked.size());
+        m_constants += "const float " + data + "[] = {";
+        for (Eigen::Index i = 0; i < value.size(); ++i)
+            m_constants += (i % 8 ? " " : "\n    ") + literal(value.data()[i]) + ",";
+        m_constants += "\n};\n";
+        code = "Eigen::Map<const " + type + ">(detail::" + data + ")";
+    }
+    m_baked[leaf] = code;
+    return code;
+}
+
+std::string Generator::function(const std::string& name, const ExpressionPtr& original, bool gradient)
+{
+    // the inputs are parameters of the generated functions, their values are not known
+    passes::Nodes inputs;
+    for (const auto& input : m_inputs)
+        inputs.insert(input.second.get());
+    const ExpressionPtr root = passes::optimize(original, inputs);
+
+    // operands before consumers
+    std::vector<Expression*> nodes = root->tape();
+    std::reverse(nodes.begin(), nodes.end());
+
+    std::unordered_map<Expression*, std::string> valueOf;
+    std::unordered_map<Expression*, std::string> adjointOf;
+    std::unordered_map<Expression*, bool> requiresGradient;
+    std::vector<bool> used(m_inputs.size(), false);
+    std::vector<bool> gradientUsed(m_inputs.size(), false);
+    std::ostringstream body;
+    Eigen::Index offset = 0;
+
+    for (auto node : nodes) {
+        const std::string id = std::to_string(valueOf.size());
+        const std::string type = arrayType(node->rows(), node->cols());
+        if (!node->op()) {
+            auto input = m_inputOf.find(node);
+            if (input == m_inputOf.end()) {
+                valueOf[node] = "v" + id;
+                body << "    const auto v" << id << " = " << bake(node) << ";\n";
+                requiresGradient[node] = false;
+                continue;
+            }
+            const int i = input->second;
+            used[size_t(i)] = true;
+            valueOf[node] = "v" + id;
+            body << "    const Eigen::Map<const " << type << "> v" << id << "(" << identifier(m_inputs[size_t(i)].first) << ");\n";
+            requiresGradient[node] = gradient && trainable(i);
+            if (requiresGradient[node]) {
+                gradientUsed[size_t(i)] = true;
+                adjointOf[node] = "a" + id;
+                body << "    Eigen::Map<" << type << "> a" << id << "(d_" << identifier(m_inputs[size_t(i)].first) << ");\n";
+            }
+            continue;
+        }
+        std::vector<std::string> x;
+        requiresGradient[node] = false;
+        for (const auto& operand : node->operands()) {
+            x.push_back(valueOf[operand.get()]);
+            requiresGradient[node] = requiresGradient[node] || requiresGradient[operand.get()];
+        }
+        valueOf[node] = "v" + id;
+        // without gradient, the root is written to the result right away
+        if (!gradient && node == root.get()) {
+            body << "    Eigen::Map<" << type << "> v" << id << "(result);\n";
+        }
+        else {
+            body << "    Eigen::Map<" << type << "> v" << id << "(workspace + " << offset << ");\n";
+            offset += node->rows() * node->cols();
+        }
+        body << "    " << evalCode(node, valueOf[node], x) << "\n";
+    }
+
+    if (gradient) {
+        Q_ASSERT(root->rows() == 1 && root->cols() == 1);
+        std::unordered_set<Expression*> assigned;
+        if (requiresGradient[root.get()]) {
+            body << "\n    // backward\n";
+            adjointOf[root.get()] = "a" + valueOf[root.get()].substr(1);
+            body << "    Eigen::Map<" << arrayType(1, 1) << "> " << adjointOf[root.get()] << "(workspace + " << offset << ");\n";
+            body << "    " << adjointOf[root.get()] << "(0, 0) = 1.f;\n";
+            offset += 1;
+        }
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            Expression* node = *it;
+            if (!node->op() || !requiresGradient[node])
+                continue;
+            std::vector<std::string> x;
+            for (const auto& operand : node->operands())
+                x.push_back(valueOf[operand.get()]);
+            for (size_t k = 0; k < node->operands().size(); ++k) {
+                Expression* child = node->operands()[k].get();
+                if (!requiresGradient[child])
+                    continue;
+                if (!adjointOf.count(child)) {
+                    adjointOf[child] = "a" + valueOf[child].substr(1);
+                    body << "    Eigen::Map<" << arrayType(child->rows(), child->cols()) << "> " << adjointOf[child]
+                         << "(workspace + " << offset << ");\n";
+                    offset += child->rows() * child->cols();
+                }
+                // inner adjoints are assigned by their first contribution, gradients of the inputs always accumulate
+                const bool accumulate = !child->op() || assigned.count(child);
+                assigned.insert(child);
+                body << "    " << vjpCode(node, int(k), adjointOf[child], accumulate, x, valueOf[node], adjointOf[node]) << "\n";
+            }
+        }
+        body << "    return " << valueOf[root.get()] << "(0, 0);\n";
+    }
+    m_workspaceSize = std::max(m_workspaceSize, offset);
+
+    std::ostringstream signature;
+    signature << "inline " << (gradient ? "float " : "void ") << identifier(name) << (gradient ? "Gradient" : "") << "(";
+    for (size_t i = 0; i < m_inputs.size(); ++i) {
+        const std::string input = identifier(m_inputs[i].first);
+        signature << "const float* " << (used[i] ? input : "/*" + input + "*/") << ", ";
+    }
+    if (gradient) {
+        for (size_t i = 0; i < m_inputs.size(); ++i) {
+            if (!trainable(int(i)))
+                continue;
+            const std::string input = "d_" + identifier(m_inputs[i].first);
+            signature << "float* " << (gradientUsed[i] ? input : "/*" + input + "*/") << ", ";
+        }
+    }
+    else {
+        signature << "float* result, ";
+    }
+    signature << "float* workspace)\n{\n";
+    return signature.str() + body.str() + "}\n";
+}
+}
+
+std::string codegen::generate(const std::string& name, const NamedExpressions& roots, const NamedExpressions& inputs)
+{
+    Generator generator(inputs);
+    std::string functions;
+    for (const auto& root : roots) {
+        functions += "\n" + generator.function(root.first, root.second, false);
+        if (root.second->rows() == 1 && root.second->cols() == 1)
+            functions += "\n" + generator.function(root.first, root.second, true);
+    }
+
+    const std::string guard = identifier(name) + "_GENERATED_H";
+    std::string code;
+    code += "// generated by codegen::generate(), do not edit\n\n";
+    code += "#ifndef " + guard + "\n#define " + guard + "\n\n";
+    code += "#include <limits>\n\n#include <Eigen/Core>\n\n";
+    code += "namespace " + identifier(name) + " {\n";
+    code += "// scratch memory of the functions below, in floats\n";
+    code += "const int workspaceSize = " + std::to_string(std::max(generator.workspaceSize(), Eigen::Index(1))) + ";\n";
+    if (!generator.constants().empty())
+        code += "\nnamespace detail {\n" + generator.constants() + "}\n";
+    code += functions;
+    code += "}\n\n#endif // " + guard + "\n";
+    return code;
+}
+
+bool codegen::write(const QString& path, const std::string& name, const NamedExpressions& roots, const NamedExpressions& inputs)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    const std::string code = generate(name, roots, inputs);
+    return file.write(code.data(), qint64(code.size())) == qint64(code.size());
+}
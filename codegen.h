@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QString>
+
+#include "Expression.h"
+
+// ahead of time compilation of expression graphs into a standalone C++ header (depending on Eigen only).
+//
+// for every root, the header contains a function with straight line forward code, and for 1x1 roots also one with
+// the gradient code. all shapes are compile time constants, values are accessed through fixed size Eigen maps.
+// leaves listed as inputs become pointer arguments (column major, in the order given), all other leaves are baked
+// into the header with their current value. nothing is allocated, scratch memory is passed in:
+//
+//   namespace <name> {
+//   const int workspaceSize = ...;  // floats, enough for any of the functions below
+//   inline void <root>(const float* <input>..., float* result, float* workspace);
+//   // accumulates into the gradient of every input that is a trainable variable, returns the value of the root
+//   inline float <root>Gradient(const float* <input>..., float* d_<variable>..., float* workspace);
+//   }
+//
+// names are turned into identifiers by replacing anything but letters, digits and underscores.
+namespace codegen {
+using NamedExpressions = std::vector<std::pair<std::string, ExpressionPtr>>;
+
+std::string generate(const std::string& name, const NamedExpressions& roots, const NamedExpressions& inputs);
+bool write(const QString& path, const std::string& name, const NamedExpressions& roots, const NamedExpressions& inputs);
+}
+
+#endif // CODEGEN_H
@@ -0,0 +1,188 @@
+// generated by codegen::generate(), do not edit
+
+#ifndef generatedNet_GENERATED_H
+#define generatedNet_GENERATED_H
+
+#include <limits>
+
+#include <Eigen/Core>
+
+namespace generatedNet {
+// scratch memory of the functions below, in floats
+const int workspaceSize = 102;
+
+inline void out(const float* input, const float* /*target*/, const float* layer0_W, const float* layer0_b, const float* layer1_W, const float* layer1_b, const float* layer2_W, const float* layer2_b, float* result, float* workspace)
+{
+    const Eigen::Map<const Eigen::Array<float, 3, 4>> v0(layer2_W);
+    const Eigen::Map<const Eigen::Array<float, 4, 5>> v1(layer1_W);
+    const Eigen::Map<const Eigen::Array<float, 5, 6>> v2(layer0_W);
+    const Eigen::Map<const Eigen::Array<float, 6, 1>> v3(input);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v4(workspace + 0);
+    v4.matrix().noalias() = v2.matrix() * v3.matrix();
+    const Eigen::Map<const Eigen::Array<float, 5, 1>> v5(layer0_b);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v6(workspace + 5);
+    v6 = v4 - v5;
+    Eigen::Map<Eigen::Array<float, 5, 1>> v7(workspace + 10);
+    v7 = v6.max(v6 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v8(workspace + 15);
+    v8.matrix().noalias() = v1.matrix() * v7.matrix();
+    const Eigen::Map<const Eigen::Array<float, 4, 1>> v9(layer1_b);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v10(workspace + 19);
+    v10 = v8 - v9;
+    Eigen::Map<Eigen::Array<float, 4, 1>> v11(workspace + 23);
+    v11 = v10.max(v10 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v12(workspace + 27);
+    v12.matrix().noalias() = v0.matrix() * v11.matrix();
+    const Eigen::Map<const Eigen::Array<float, 3, 1>> v13(layer2_b);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v14(workspace + 30);
+    v14 = v12 - v13;
+    Eigen::Map<Eigen::Array<float, 3, 1>> v15(workspace + 33);
+    v15 = (v14 - v14.maxCoeff()).exp();
+    Eigen::Map<Eigen::Array<float, 1, 1>> v16(workspace + 36);
+    v16(0, 0) = v15.sum();
+    Eigen::Map<Eigen::Array<float, 3, 1>> v17(result);
+    v17 = v15 / v16(0, 0);
+}
+
+inline void cost(const float* input, const float* target, const float* layer0_W, const float* layer0_b, const float* layer1_W, const float* layer1_b, const float* layer2_W, const float* layer2_b, float* result, float* workspace)
+{
+    const auto v0 = Eigen::Array<float, 1, 1>::Constant(-1.0f);
+    const Eigen::Map<const Eigen::Array<float, 3, 1>> v1(target);
+    const Eigen::Map<const Eigen::Array<float, 3, 4>> v2(layer2_W);
+    const Eigen::Map<const Eigen::Array<float, 4, 5>> v3(layer1_W);
+    const Eigen::Map<const Eigen::Array<float, 5, 6>> v4(layer0_W);
+    const Eigen::Map<const Eigen::Array<float, 6, 1>> v5(input);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v6(workspace + 0);
+    v6.matrix().noalias() = v4.matrix() * v5.matrix();
+    const Eigen::Map<const Eigen::Array<float, 5, 1>> v7(layer0_b);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v8(workspace + 5);
+    v8 = v6 - v7;
+    Eigen::Map<Eigen::Array<float, 5, 1>> v9(workspace + 10);
+    v9 = v8.max(v8 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v10(workspace + 15);
+    v10.matrix().noalias() = v3.matrix() * v9.matrix();
+    const Eigen::Map<const Eigen::Array<float, 4, 1>> v11(layer1_b);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v12(workspace + 19);
+    v12 = v10 - v11;
+    Eigen::Map<Eigen::Array<float, 4, 1>> v13(workspace + 23);
+    v13 = v12.max(v12 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v14(workspace + 27);
+    v14.matrix().noalias() = v2.matrix() * v13.matrix();
+    const Eigen::Map<const Eigen::Array<float, 3, 1>> v15(layer2_b);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v16(workspace + 30);
+    v16 = v14 - v15;
+    Eigen::Map<Eigen::Array<float, 3, 1>> v17(workspace + 33);
+    v17 = (v16 - v16.maxCoeff()).exp();
+    Eigen::Map<Eigen::Array<float, 1, 1>> v18(workspace + 36);
+    v18(0, 0) = v17.sum();
+    Eigen::Map<Eigen::Array<float, 3, 1>> v19(workspace + 37);
+    v19 = v17 / v18(0, 0);
+    const auto v20 = Eigen::Array<float, 1, 1>::Constant(9.99999994e-09f);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v21(workspace + 40);
+    v21 = v19 + v20(0, 0);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v22(workspace + 43);
+    v22 = v21.log();
+    Eigen::Map<Eigen::Array<float, 3, 1>> v23(workspace + 46);
+    v23 = v1 * v22;
+    Eigen::Map<Eigen::Array<float, 1, 1>> v24(workspace + 49);
+    v24(0, 0) = v23.sum();
+    Eigen::Map<Eigen::Array<float, 1, 1>> v25(result);
+    v25 = v0 * v24;
+}
+
+inline float costGradient(const float* input, const float* target, const float* layer0_W, const float* layer0_b, const float* layer1_W, const float* layer1_b, const float* layer2_W, const float* layer2_b, float* d_layer0_W, float* d_layer0_b, float* d_layer1_W, float* d_layer1_b, float* d_layer2_W, float* d_layer2_b, float* workspace)
+{
+    const auto v0 = Eigen::Array<float, 1, 1>::Constant(-1.0f);
+    const Eigen::Map<const Eigen::Array<float, 3, 1>> v1(target);
+    const Eigen::Map<const Eigen::Array<float, 3, 4>> v2(layer2_W);
+    Eigen::Map<Eigen::Array<float, 3, 4>> a2(d_layer2_W);
+    const Eigen::Map<const Eigen::Array<float, 4, 5>> v3(layer1_W);
+    Eigen::Map<Eigen::Array<float, 4, 5>> a3(d_layer1_W);
+    const Eigen::Map<const Eigen::Array<float, 5, 6>> v4(layer0_W);
+    Eigen::Map<Eigen::Array<float, 5, 6>> a4(d_layer0_W);
+    const Eigen::Map<const Eigen::Array<float, 6, 1>> v5(input);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v6(workspace + 0);
+    v6.matrix().noalias() = v4.matrix() * v5.matrix();
+    const Eigen::Map<const Eigen::Array<float, 5, 1>> v7(layer0_b);
+    Eigen::Map<Eigen::Array<float, 5, 1>> a7(d_layer0_b);
+    Eigen::Map<Eigen::Array<float, 5, 1>> v8(workspace + 5);
+    v8 = v6 - v7;
+    Eigen::Map<Eigen::Array<float, 5, 1>> v9(workspace + 10);
+    v9 = v8.max(v8 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v10(workspace + 15);
+    v10.matrix().noalias() = v3.matrix() * v9.matrix();
+    const Eigen::Map<const Eigen::Array<float, 4, 1>> v11(layer1_b);
+    Eigen::Map<Eigen::Array<float, 4, 1>> a11(d_layer1_b);
+    Eigen::Map<Eigen::Array<float, 4, 1>> v12(workspace + 19);
+    v12 = v10 - v11;
+    Eigen::Map<Eigen::Array<float, 4, 1>> v13(workspace + 23);
+    v13 = v12.max(v12 * 0.01f);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v14(workspace + 27);
+    v14.matrix().noalias() = v2.matrix() * v13.matrix();
+    const Eigen::Map<const Eigen::Array<float, 3, 1>> v15(layer2_b);
+    Eigen::Map<Eigen::Array<float, 3, 1>> a15(d_layer2_b);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v16(workspace + 30);
+    v16 = v14 - v15;
+    Eigen::Map<Eigen::Array<float, 3, 1>> v17(workspace + 33);
+    v17 = (v16 - v16.maxCoeff()).exp();
+    Eigen::Map<Eigen::Array<float, 1, 1>> v18(workspace + 36);
+    v18(0, 0) = v17.sum();
+    Eigen::Map<Eigen::Array<float, 3, 1>> v19(workspace + 37);
+    v19 = v17 / v18(0, 0);
+    const auto v20 = Eigen::Array<float, 1, 1>::Constant(9.99999994e-09f);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v21(workspace + 40);
+    v21 = v19 + v20(0, 0);
+    Eigen::Map<Eigen::Array<float, 3, 1>> v22(workspace + 43);
+    v22 = v21.log();
+    Eigen::Map<Eigen::Array<float, 3, 1>> v23(workspace + 46);
+    v23 = v1 * v22;
+    Eigen::Map<Eigen::Array<float, 1, 1>> v24(workspace + 49);
+    v24(0, 0) = v23.sum();
+    Eigen::Map<Eigen::Array<float, 1, 1>> v25(workspace + 50);
+    v25 = v0 * v24;
+
+    // backward
+    Eigen::Map<Eigen::Array<float, 1, 1>> a25(workspace + 51);
+    a25(0, 0) = 1.f;
+    Eigen::Map<Eigen::Array<float, 1, 1>> a24(workspace + 52);
+    a24 = a25 * v0;
+    Eigen::Map<Eigen::Array<float, 3, 1>> a23(workspace + 53);
+    a23.setConstant(a24(0, 0));
+    Eigen::Map<Eigen::Array<float, 3, 1>> a22(workspace + 56);
+    a22 = a23 * v1;
+    Eigen::Map<Eigen::Array<float, 3, 1>> a21(workspace + 59);
+    a21 = a22 / v21;
+    Eigen::Map<Eigen::Array<float, 3, 1>> a19(workspace + 62);
+    a19 = a21;
+    Eigen::Map<Eigen::Array<float, 3, 1>> a17(workspace + 65);
+    a17 = a19 / v18(0, 0);
+    Eigen::Map<Eigen::Array<float, 1, 1>> a18(workspace + 68);
+    a18(0, 0) = (-a19 * v17 / (v18(0, 0) * v18(0, 0))).sum();
+    a17 += a18(0, 0);
+    Eigen::Map<Eigen::Array<float, 3, 1>> a16(workspace + 69);
+    a16 = a17 * v17;
+    Eigen::Map<Eigen::Array<float, 3, 1>> a14(workspace + 72);
+    a14 = a16;
+    a15 += -a16;
+    a2.matrix().noalias() += a14.matrix() * v13.matrix().transpose();
+    Eigen::Map<Eigen::Array<float, 4, 1>> a13(workspace + 75);
+    a13.matrix().noalias() = v2.matrix().transpose() * a14.matrix();
+    Eigen::Map<Eigen::Array<float, 4, 1>> a12(workspace + 79);
+    a12 = a13 * ((v12 > 0.f).cast<float>() * 0.99f + 0.01f);
+    Eigen::Map<Eigen::Array<float, 4, 1>> a10(workspace + 83);
+    a10 = a12;
+    a11 += -a12;
+    a3.matrix().noalias() += a10.matrix() * v9.matrix().transpose();
+    Eigen::Map<Eigen::Array<float, 5, 1>> a9(workspace + 87);
+    a9.matrix().noalias() = v3.matrix().transpose() * a10.matrix();
+    Eigen::Map<Eigen::Array<float, 5, 1>> a8(workspace + 92);
+    a8 = a9 * ((v8 > 0.f).cast<float>() * 0.99f + 0.01f);
+    Eigen::Map<Eigen::Array<float, 5, 1>> a6(workspace + 97);
+    a6 = a8;
+    a7 += -a8;
+    a4.matrix().noalias() += a6.matrix() * v5.matrix().transpose();
+    return v25(0, 0);
+}
+}
+
+#endif // generatedNet_GENERATED_H
@@ -38,6 +38,7 @@
 #include "Expression.h"
 #include "nn.h"
 #include "Tests.h"
+#include "Benchmarks.h"
 
 
 std::vector<std::pair<ArrayXX, QString>> getData(QString path) {
@@ -76,6 +77,7 @@ int number(const ArrayXX& vec) {
 int main(int argc, char *argv[])
 {
 //	test();
+//	benchmark();
 //	return 0;
     auto trainingList = getData("/home/madam/Downloads/mnist_png/training");
     std::random_shuffle(trainingList.begin(), trainingList.end());
@@ -104,11 +106,10 @@ int main(int argc, char *argv[])
             for (; i < batchEnd; ++i) {
                 auto x = getImage(trainingList.at(i).second);
                 auto y = trainingList.at(i).first;
-                float loss = net->loss(x, y);
+                float loss = net->accumulateGradient(x, y);
                 cost += loss;
-                net->costOutExpr->differentiateBackward();
 
-                auto yPred = net->output(x);
+                const auto& yPred = net->output(x);
 //				std::cout << "pred: " << yPred.transpose() << "\ntarget: " << y.transpose() << "loss: " << loss << std::endl;
 
 				good += number(y) == number(yPred);
@@ -126,7 +127,7 @@ int main(int argc, char *argv[])
         for (const auto& dataPair : testList) {
             auto x = getImage(dataPair.second);
             auto y = dataPair.first;
-            auto yPred = net->output(x);
+            const auto& yPred = net->output(x);
             good += number(y) == number(yPred);
             cost += net->loss(x, y);
         }
@@ -29,16 +29,19 @@
 
 #include "nn.h"
 
+#include <algorithm>
+
 namespace  {
-inline ExpressionPtr epsLike(ExpressionPtr mat) {
-    return Constant::make(mat->rows(), mat->cols(), 0.00000001f);
+// scalar constants, the element wise operators broadcast them to the size of the other operand
+inline ExpressionPtr epsLike(ExpressionPtr) {
+    return Constant::make(0.00000001f);
 }
 
-inline ExpressionPtr onesLike(ExpressionPtr mat) {
-    return Constant::make(mat->rows(), mat->cols(), 1);
+inline ExpressionPtr onesLike(ExpressionPtr) {
+    return Constant::make(1);
 }
-inline ExpressionPtr zerosLike(ExpressionPtr mat) {
-    return Constant::make(mat->rows(), mat->cols(), 0);
+inline ExpressionPtr zerosLike(ExpressionPtr) {
+    return Constant::make(0);
 }
 }
 
@@ -58,16 +61,14 @@ ExpressionPtr nn::numerical_instable_softmax(ExpressionPtr mat)
 {
     Q_ASSERT(mat->cols() == 1);
     auto exponentials = exp(mat);
-    auto sum = onesLike(mat) * reduceSum(exponentials);
-    return cwisediv(exponentials, sum);
+    return cwisediv(exponentials, reduceSum(exponentials));
 }
 
 ExpressionPtr nn::softmax(ExpressionPtr mat)
 {
     Q_ASSERT(mat->cols() == 1);
     auto exponentials = normExp(mat);
-    auto sum = onesLike(mat) * reduceSum(exponentials);
-    return cwisediv(exponentials, sum);
+    return cwisediv(exponentials, reduceSum(exponentials));
 }
 
 ExpressionPtr nn::mse(ExpressionPtr a, ExpressionPtr b)
@@ -88,6 +89,79 @@ ExpressionPtr nn::crossEntropy2(ExpressionPtr pred, ExpressionPtr truth)
     return Constant::make(1, 1, -1) * reduceSum(cwisemul(truth, log(pred + eps)) + cwisemul((ones - truth), log(ones - pred + eps)));
 }
 
+bool nn::Net::save(const QString& path) const
+{
+    serialization::NamedExpressions roots = {{"input", input}, {"target", target}, {"out", outExpr}, {"cost", costOutExpr}};
+    for (size_t i = 0; i < layers.size(); ++i) {
+        const std::string prefix = "layer" + std::to_string(i) + ".";
+        roots.emplace_back(prefix + "W", layers[i]->W);
+        roots.emplace_back(prefix + "b", layers[i]->b);
+        roots.emplace_back(prefix + "out", layers[i]->out);
+    }
+    return serialization::save(path, roots, {{"learningRate", learningRate}, {"checkpointing", checkpointing ? 1.f : 0.f}});
+}
+
+bool nn::Net::generateCode(const QString& path, const std::string& name) const
+{
+    codegen::NamedExpressions inputs = {{"input", input}, {"target", target}};
+    for (size_t i = 0; i < layers.size(); ++i) {
+        const std::string prefix = "layer" + std::to_string(i) + "_";
+        inputs.emplace_back(prefix + "W", layers[i]->W);
+        inputs.emplace_back(prefix + "b", layers[i]->b);
+    }
+    return codegen::write(path, name, {{"out", outExpr}, {"cost", costOutExpr}}, inputs);
+}
+
+nn::NetPtr nn::Net::load(const QString& path)
+{
+    serialization::Metadata metadata;
+    const auto roots = serialization::load(path, &metadata);
+    auto find = [&roots](const std::string& name) -> ExpressionPtr {
+        for (const auto& root : roots) {
+            if (root.first == name)
+                return root.second;
+        }
+        return nullptr;
+    };
+    auto variable = [&find](const std::string& name) {
+        return std::dynamic_pointer_cast<Variable>(find(name));
+    };
+
+    NetPtr net = std::make_shared<Net>();
+    net->input = variable("input");
+    net->target = variable("target");
+    net->outExpr = find("out");
+    net->costOutExpr = find("cost");
+    const auto learningRate = std::find_if(metadata.begin(), metadata.end(), [](const std::pair<std::string, float>& entry) {
+        return entry.first == "learningRate";
+    });
+    if (!net->input || !net->target || !net->outExpr || !net->costOutExpr || learningRate == metadata.end())
+        return nullptr;
+    net->learningRate = learningRate->second;
+    net->input->setMutable(true);
+    net->target->setMutable(true);
+    for (size_t i = 0; find("layer" + std::to_string(i) + ".out"); ++i) {
+        const std::string prefix = "layer" + std::to_string(i) + ".";
+        LayerPtr layer = std::make_shared<Layer>();
+        layer->W = variable(prefix + "W");
+        layer->b = variable(prefix + "b");
+        layer->out = find(prefix + "out");
+        if (!layer->W || !layer->b)
+            return nullptr;
+        // as in Layer::make, whatever the file says
+        layer->out->setCheckpoint(true);
+        net->layers.push_back(layer);
+    }
+    net->costPlan = Plan::make(net->costOutExpr);
+    net->outputPlan = Plan::make(net->outExpr, Plan::Mode::Inference);
+    // optional, off if missing
+    const auto checkpointing = std::find_if(metadata.begin(), metadata.end(), [](const std::pair<std::string, float>& entry) {
+        return entry.first == "checkpointing";
+    });
+    net->setCheckpointing(checkpointing != metadata.end() && checkpointing->second != 0);
+    return net;
+}
+
 //void nn::Descender::resetGradient()
 //{
 //    for (const auto& variable : variables) {
@@ -38,7 +38,11 @@
 
 #include <random>
 
+#include "Arena.h"
+#include "codegen.h"
 #include "Expression.h"
+#include "Plan.h"
+#include "serialization.h"
 
 namespace nn {
 
@@ -76,14 +80,17 @@ struct Layer {
         LayerPtr l = std::make_shared<Layer>();
         l->W = W;
         l->b = b;
-		l->out = activationFun(W * input - b * Constant::make(1, input->cols(), 1));
+		// b is broadcast over the columns of a batch
+		l->out = activationFun(W * input - b);
+        // only used if checkpointing is enabled, see Net::setCheckpointing
+        l->out->setCheckpoint(true);
 
         return l;
     }
 
     float applyGradient(float learningRate) {
-        W->value() -= W->gradient() * learningRate;
-        b->value() -= b->gradient() * learningRate;
+        W->valueForWrite() -= W->gradient() * learningRate;
+        b->valueForWrite() -= b->gradient() * learningRate;
         return W->gradient().abs().mean() * learningRate + b->gradient().abs().mean() * learningRate;
     }
     void resetGradient() {
@@ -103,7 +110,10 @@ struct Net {
     ConstantPtr target;
     ExpressionPtr outExpr;
     ExpressionPtr costOutExpr;
+    PlanPtr costPlan;
+    PlanPtr outputPlan;
     float learningRate;
+    bool checkpointing = false;
 
     template<typename ActivationFunction, typename ClassificationFunction, typename CostFunction>
     static NetPtr make(const ArrayXX& input, const ArrayXX& target, const std::vector<int>& layers,
@@ -111,6 +121,8 @@ struct Net {
         NetPtr net = std::make_shared<Net>();
         net->input = Constant::make(input);
         net->target = Constant::make(target);
+        net->input->setMutable(true);
+        net->target->setMutable(true);
 
         ExpressionPtr layerInput = net->input;
         for (auto nNeurons : layers) {
@@ -120,15 +132,24 @@ struct Net {
         net->layers.push_back(Layer::make(layerInput, int(target.rows()), classificationFun));
         net->outExpr = net->layers.back()->out;
         net->costOutExpr = costFun(net->outExpr, net->target);
+        net->costPlan = Plan::make(net->costOutExpr);
+        net->outputPlan = Plan::make(net->outExpr, Plan::Mode::Inference);
         net->learningRate = learningRate;
         return net;
     }
 
+    // training keeps only the layer outputs, the values in between are recomputed by the backward pass.
+    // goes through the expression graph instead of the compiled plan, which keeps all values.
+    void setCheckpointing(bool enabled) {
+        checkpointing = enabled;
+        costOutExpr->setCheckpointing(enabled);
+    }
+
+    // through the inference plan
     ArrayXX output(const ArrayXX& inputData) const {
         Q_ASSERT(input->rows() == inputData.rows());
-        input->value() = inputData;
-        outExpr->reset();
-        return outExpr->evalForward();
+        input->setValue(inputData);
+        return outputPlan->forward();
     }
 
     float loss(const ArrayXX& inputData, const ArrayXX& targetData) {
@@ -137,13 +158,48 @@ struct Net {
         Q_ASSERT(input->cols() == inputData.cols());
         Q_ASSERT(target->cols() == targetData.cols());
 
-        input->value() = inputData;
-        target->value() = targetData;
-
-        costOutExpr->reset();
+        // only the part of the graph that depends on a changed input is evaluated again
+        input->setValue(inputData);
+        target->setValue(targetData);
         return  costOutExpr->evalForward()(0);
     }
 
+    // loss and gradient in one go, through the compiled plan unless checkpointing is enabled. gradients are accumulated until the next resetGradient()
+    float accumulateGradient(const ArrayXX& inputData, const ArrayXX& targetData) {
+        Q_ASSERT(input->rows() == inputData.rows());
+        Q_ASSERT(target->rows() == targetData.rows());
+        Q_ASSERT(input->cols() == inputData.cols());
+        Q_ASSERT(target->cols() == targetData.cols());
+
+        input->setValue(inputData);
+        target->setValue(targetData);
+
+        if (checkpointing) {
+            auto error = costOutExpr->evalForward()(0);
+            costOutExpr->differentiateBackward();
+            return error;
+        }
+        auto error = costPlan->forward()(0);
+        costPlan->backward();
+        return error;
+    }
+
+    std::vector<VariablePtr> parameters() const {
+        std::vector<VariablePtr> params;
+        for (const auto& layer : layers) {
+            params.push_back(layer->W);
+            params.push_back(layer->b);
+        }
+        return params;
+    }
+
+    // hessian of the loss times v, v holds one array per parameter (see parameters())
+    std::vector<ArrayXX> hessianVectorProduct(const ArrayXX& inputData, const ArrayXX& targetData, const std::vector<ArrayXX>& v) {
+        input->setValue(inputData);
+        target->setValue(targetData);
+        return hvp(costOutExpr, parameters(), v);
+    }
+
     void applyGradient(bool debug_out = false)
     {
         int idx = 0;
@@ -166,8 +222,8 @@ struct Net {
     float learn(const ArrayXX& inputData, const ArrayXX& targetData) {
 //        printWeights();
         resetGradient();
-        auto error = loss(inputData, targetData);
-        costOutExpr->differentiateBackward();
+        g_arena.reset();
+        auto error = accumulateGradient(inputData, targetData);
 
         applyGradient();
         printWeights();
@@ -175,6 +231,13 @@ struct Net {
         return error;
     }
 
+    // graph and weights, see serialization.h. load() returns nullptr on failure.
+    bool save(const QString& path) const;
+    static NetPtr load(const QString& path);
+    // standalone C++ header with out() and costGradient(), see codegen.h. the arguments are input, target and
+    // the weights and biases of all layers (layer0_W, layer0_b, ...).
+    bool generateCode(const QString& path, const std::string& name) const;
+
     void printWeights() const {
         int idx = 0;
         static bool print = true;
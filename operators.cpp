@@ -34,6 +34,191 @@
 
 #include <QtGlobal>
 
+namespace {
+// calls function(x) with x expanded to rows x cols. operands of size 1x1, rows x 1 and 1 x cols are
+// repeated lazily, nothing is materialised.
+template<typename Function>
+void expand(const ConstArrayRef& x, Eigen::Index rows, Eigen::Index cols, const Function& function)
+{
+    if (x.rows() == rows && x.cols() == cols) {
+        function(x);
+    } else if (x.size() == 1) {
+        function(ArrayXX::Constant(rows, cols, x(0, 0)));
+    } else if (x.cols() == 1) {
+        Q_ASSERT(x.rows() == rows);
+        function(x.col(0).rowwise().replicate(cols));
+    } else {
+        Q_ASSERT(x.rows() == 1 && x.cols() == cols);
+        function(x.row(0).colwise().replicate(rows));
+    }
+}
+
+// same as above for a value and its tangent, which have the same size
+template<typename Function>
+void expand(const ConstArrayRef& x, const ConstArrayRef& tangent, Eigen::Index rows, Eigen::Index cols, const Function& function)
+{
+    if (x.rows() == rows && x.cols() == cols) {
+        function(x, tangent);
+    } else if (x.size() == 1) {
+        function(ArrayXX::Constant(rows, cols, x(0, 0)), ArrayXX::Constant(rows, cols, tangent(0, 0)));
+    } else if (x.cols() == 1) {
+        Q_ASSERT(x.rows() == rows);
+        function(x.col(0).rowwise().replicate(cols), tangent.col(0).rowwise().replicate(cols));
+    } else {
+        Q_ASSERT(x.rows() == 1 && x.cols() == cols);
+        function(x.row(0).colwise().replicate(rows), tangent.row(0).colwise().replicate(rows));
+    }
+}
+
+template<typename Function, typename A>
+struct ExpandedA {
+    const A& a;
+    const Function& function;
+    template<typename B> void operator()(const B& b) const { function(a, b); }
+};
+template<typename Function>
+struct ExpandB {
+    const ConstArrayRef& b;
+    Eigen::Index rows, cols;
+    const Function& function;
+    template<typename A> void operator()(const A& a) const { expand(b, rows, cols, ExpandedA<Function, A>{a, function}); }
+};
+
+template<typename Function, typename A, typename TA>
+struct ExpandedATangent {
+    const A& a;
+    const TA& tangentA;
+    const Function& function;
+    template<typename B, typename TB> void operator()(const B& b, const TB& tangentB) const { function(a, tangentA, b, tangentB); }
+};
+template<typename Function>
+struct ExpandBTangent {
+    const ConstArrayRef& b;
+    const ConstArrayRef& tangentB;
+    Eigen::Index rows, cols;
+    const Function& function;
+    template<typename A, typename TA> void operator()(const A& a, const TA& tangentA) const {
+        expand(b, tangentB, rows, cols, ExpandedATangent<Function, A, TA>{a, tangentA, function});
+    }
+};
+
+// calls function(a, b) with both operands expanded to rows x cols, numpy style: the size of an operand
+// along each dimension is either the same as the result's or 1.
+template<typename Function>
+void broadcast(const ConstArrayRef& a, const ConstArrayRef& b, Eigen::Index rows, Eigen::Index cols, const Function& function)
+{
+    expand(a, rows, cols, ExpandB<Function>{b, rows, cols, function});
+}
+
+// sums up the contributions of broadcast elements, out has the size of the operand
+template<typename Derived>
+void reduceTo(const Eigen::ArrayBase<Derived>& contribution, ArrayRef out)
+{
+    if (out.rows() == contribution.rows() && out.cols() == contribution.cols())
+        out = contribution;
+    else if (out.size() == 1)
+        out(0, 0) = contribution.sum();
+    else if (out.cols() == 1)
+        out = contribution.rowwise().sum();
+    else
+        out = contribution.colwise().sum();
+}
+
+// same as above, with the tangents of a and b expanded along with them
+template<typename Function>
+void broadcast(const ConstArrayRef& a, const ConstArrayRef& tangentA, const ConstArrayRef& b, const ConstArrayRef& tangentB,
+               Eigen::Index rows, Eigen::Index cols, const Function& function)
+{
+    expand(a, tangentA, rows, cols, ExpandBTangent<Function>{b, tangentB, rows, cols, function});
+}
+
+struct AddKernel {
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B& b) const { out = a + b; }
+};
+struct AssignKernel {
+    ArrayRef& out;
+    template<typename X> void operator()(const X& x) const { out = x; }
+};
+struct AccumulateKernel {
+    ArrayRef& out;
+    template<typename X> void operator()(const X& x) const { out += x; }
+};
+struct SubtractKernel {
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B& b) const { out = a - b; }
+};
+struct MulKernel {
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B& b) const { out = a * b; }
+};
+struct DivKernel {
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B& b) const { out = a / b; }
+};
+struct MulJvpKernel {
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A& a, const TA& tangentA, const B& b, const TB& tangentB) const { out = tangentA * b + a * tangentB; }
+};
+struct DivJvpKernel {
+    const ConstArrayRef& result;
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A&, const TA& tangentA, const B& b, const TB& tangentB) const { out = (tangentA - result * tangentB) / b; }
+};
+struct MulVjpAKernel {
+    const ConstArrayRef& back;
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A&, const B& b) const { reduceTo(back * b, out); }
+};
+struct MulVjpBKernel {
+    const ConstArrayRef& back;
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B&) const { reduceTo(back * a, out); }
+};
+struct DivVjpAKernel {
+    const ConstArrayRef& back;
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A&, const B& b) const { reduceTo(back / b, out); }
+};
+struct MulVjpTangentAKernel {
+    const ConstArrayRef& back;
+    const ConstArrayRef& tangentBack;
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A&, const TA&, const B& b, const TB& tangentB) const { reduceTo(tangentBack * b + back * tangentB, out); }
+};
+struct MulVjpTangentBKernel {
+    const ConstArrayRef& back;
+    const ConstArrayRef& tangentBack;
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A& a, const TA& tangentA, const B&, const TB&) const { reduceTo(tangentBack * a + back * tangentA, out); }
+};
+struct DivVjpTangentAKernel {
+    const ConstArrayRef& back;
+    const ConstArrayRef& tangentBack;
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A&, const TA&, const B& b, const TB& tangentB) const { reduceTo((tangentBack - back * tangentB / b) / b, out); }
+};
+struct DivVjpTangentBKernel {
+    const ConstArrayRef& back;
+    const ConstArrayRef& tangentBack;
+    ArrayRef& out;
+    template<typename A, typename TA, typename B, typename TB>
+    void operator()(const A& a, const TA& tangentA, const B& b, const TB& tangentB) const {
+        reduceTo(-(tangentBack * a + back * tangentA) / (b * b) + 2.f * back * a * tangentB / (b * b * b), out);
+    }
+};
+struct DivVjpBKernel {
+    const ConstArrayRef& back;
+    ArrayRef& out;
+    template<typename A, typename B> void operator()(const A& a, const B& b) const { reduceTo(-back * a / (b * b), out); }
+};
+}
+
 namespace operators {
 Add g_add;
 Subtract g_subtract;
@@ -47,25 +232,26 @@ Vvt g_vvt;
 MatMul g_matMul;
 ReduceSum g_reduceSum;
 ReduceProd g_reduceProd;
+Sum g_sum;
 
-ArrayXX Base::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void Base::vjpA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return ArrayXX::Constant(a.rows(), a.cols(), 1);
+    out = back;
 }
 
-ArrayXX Base::differentiateWrtB(const ArrayXX&, const ArrayXX& b)
+void Base::vjpB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return ArrayXX::Constant(b.rows(), b.cols(), 1);
+    out = back;
 }
 
-ArrayXX Base::chainA(const ArrayXX& back, const ArrayXX& dA)
+void Base::vjpTangentA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return back * dA;
+    out = tangentBack;
 }
 
-ArrayXX Base::chainB(const ArrayXX& back, const ArrayXX& dB)
+void Base::vjpTangentB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return back * dB;
+    out = tangentBack;
 }
 
 Size Base::outSize(const Size& sizeA, const Size& sizeB)
@@ -74,9 +260,45 @@ Size Base::outSize(const Size& sizeA, const Size& sizeB)
     return Size(sizeA(0), sizeB(1));
 }
 
-ArrayXX UnaryBase::chainB(const ArrayXX&, const ArrayXX& dB)
+void Base::evalN(const Operands& x, ArrayRef out)
+{
+    eval(x.front(), x.back(), out);
+}
+
+void Base::vjpN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    if (k == 0)
+        vjpA(x.front(), x.back(), result, back, out);
+    else
+        vjpB(x.front(), x.back(), result, back, out);
+}
+
+void Base::vjpTangentN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, const Operands& tangents, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    if (k == 0)
+        vjpTangentA(x.front(), x.back(), result, back, tangents.front(), tangents.back(), tangentResult, tangentBack, out);
+    else
+        vjpTangentB(x.front(), x.back(), result, back, tangents.front(), tangents.back(), tangentResult, tangentBack, out);
+}
+
+void Base::jvpN(const Operands& x, const ConstArrayRef& result, const Operands& tangents, ArrayRef out)
+{
+    jvp(x.front(), x.back(), result, tangents.front(), tangents.back(), out);
+}
+
+Size Base::outSizeN(const std::vector<Size>& sizes)
+{
+    return outSize(sizes.front(), sizes.back());
+}
+
+void VariadicBase::eval(const ConstArrayRef&, const ConstArrayRef&, ArrayRef)
 {
-    return dB;
+    Q_ASSERT(false);
+}
+
+void VariadicBase::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, ArrayRef)
+{
+    Q_ASSERT(false);
 }
 
 Size UnaryBase::outSize(const Size& sizeA, const Size&)
@@ -84,167 +306,448 @@ Size UnaryBase::outSize(const Size& sizeA, const Size&)
     return sizeA;
 }
 
-ArrayXX Subtract::differentiateWrtB(const ArrayXX&, const ArrayXX& b)
+void ElementwiseBase::vjpA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    reduceTo(back, out);
+}
+
+void ElementwiseBase::vjpB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    reduceTo(back, out);
+}
+
+void ElementwiseBase::vjpTangentA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    reduceTo(tangentBack, out);
+}
+
+void ElementwiseBase::vjpTangentB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    reduceTo(tangentBack, out);
+}
+
+Size ElementwiseBase::outSize(const Size& sizeA, const Size& sizeB)
+{
+    Q_ASSERT((sizeA(0) == sizeB(0) || sizeA(0) == 1 || sizeB(0) == 1) && (sizeA(1) == sizeB(1) || sizeA(1) == 1 || sizeB(1) == 1));
+    return Size(sizeA(0) == 1 ? sizeB(0) : sizeA(0), sizeA(1) == 1 ? sizeB(1) : sizeA(1));
+}
+
+void Add::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
+{
+    broadcast(a, b, out.rows(), out.cols(), AddKernel{out});
+}
+
+void Add::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
+{
+    broadcast(tangentA, tangentB, out.rows(), out.cols(), AddKernel{out});
+}
+
+void Subtract::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
+{
+    broadcast(a, b, out.rows(), out.cols(), SubtractKernel{out});
+}
+
+void Subtract::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
+{
+    broadcast(tangentA, tangentB, out.rows(), out.cols(), SubtractKernel{out});
+}
+
+void Subtract::vjpB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    reduceTo(-back, out);
+}
+
+void Subtract::vjpTangentB(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    reduceTo(-tangentBack, out);
+}
+
+void Mul::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
+{
+    broadcast(a, b, out.rows(), out.cols(), MulKernel{out});
+}
+
+void Mul::jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
+{
+    broadcast(a, tangentA, b, tangentB, out.rows(), out.cols(), MulJvpKernel{out});
+}
+
+void Mul::vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    broadcast(a, b, back.rows(), back.cols(), MulVjpAKernel{back, out});
+}
+
+void Mul::vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    broadcast(a, tangentA, b, tangentB, back.rows(), back.cols(), MulVjpTangentAKernel{back, tangentBack, out});
+}
+
+void Mul::vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    broadcast(a, b, back.rows(), back.cols(), MulVjpBKernel{back, out});
+}
+
+void Mul::vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return ArrayXX::Constant(b.rows(), b.cols(), -1);
+    broadcast(a, tangentA, b, tangentB, back.rows(), back.cols(), MulVjpTangentBKernel{back, tangentBack, out});
 }
 
-ArrayXX Mul::differentiateWrtA(const ArrayXX&, const ArrayXX& b)
+void Div::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
 {
-    return b;
+    broadcast(a, b, out.rows(), out.cols(), DivKernel{out});
 }
 
-ArrayXX Mul::differentiateWrtB(const ArrayXX& a, const ArrayXX&)
+void Div::jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
 {
-    return a;
+    broadcast(a, tangentA, b, tangentB, out.rows(), out.cols(), DivJvpKernel{result, out});
 }
 
-ArrayXX Div::differentiateWrtA(const ArrayXX&, const ArrayXX& b)
+void Div::vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return 1 / b;
+    broadcast(a, b, back.rows(), back.cols(), DivVjpAKernel{back, out});
 }
 
-ArrayXX Div::differentiateWrtB(const ArrayXX& a, const ArrayXX& b)
+void Div::vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return -a / (b * b);
+    broadcast(a, tangentA, b, tangentB, back.rows(), back.cols(), DivVjpTangentAKernel{back, tangentBack, out});
 }
 
-ArrayXX Log::eval(const ArrayXX& a, const ArrayXX&)
+void Div::vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return Eigen::log(a);
+    broadcast(a, b, back.rows(), back.cols(), DivVjpBKernel{back, out});
 }
 
-ArrayXX Log::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void Div::vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return 1.f / a;
+    broadcast(a, tangentA, b, tangentB, back.rows(), back.cols(), DivVjpTangentBKernel{back, tangentBack, out});
 }
 
-ArrayXX Exp::eval(const ArrayXX& a, const ArrayXX&)
+void Log::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
 {
-    return a.exp();
+    out = Eigen::log(a);
 }
 
-ArrayXX Exp::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void Log::jvp(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
 {
-    return a.exp();
+    out = tangentA / a;
 }
 
-ArrayXX NormExp::eval(const ArrayXX& a, const ArrayXX& )
+void Log::vjpA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    out = back / a;
+}
+
+void Log::vjpTangentA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    out = (tangentBack - back * tangentA / a) / a;
+}
+
+void Exp::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
+{
+    out = a.exp();
+}
+
+void Exp::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
+{
+    out = tangentA * result;
+}
+
+void Exp::vjpA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    out = back * result;
+}
+
+void Exp::vjpTangentA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    out = tangentBack * result + back * tangentResult;
+}
+
+void NormExp::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
 {
 //	std::cout << "NormExp: " << a.transpose() - a.maxCoeff() << std::endl;
 //	std::cout << "NormExp: " << (a.transpose() - a.maxCoeff()).exp() << std::endl;
-	return (a - a.maxCoeff()).exp();
+	out = (a - a.maxCoeff()).exp();
 }
 
-ArrayXX NormExp::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void NormExp::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
 {
-	return (a - a.maxCoeff()).exp();
+    // the max is treated as a constant, as in vjpA
+    out = tangentA * result;
 }
 
-ArrayXX Vvt::eval(const ArrayXX& a, const ArrayXX& b)
+void NormExp::vjpA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    // the max is treated as a constant
+    out = back * result;
+}
+
+void NormExp::vjpTangentA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    out = tangentBack * result + back * tangentResult;
+}
+
+void Vvt::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
 {
     Q_ASSERT(a.cols() == 1);
     Q_ASSERT(b.rows() == 1);
-    return a.matrix() * b.matrix();
+    out.matrix().noalias() = a.matrix() * b.matrix();
 }
 
-ArrayXX Vvt::differentiateWrtA(const ArrayXX& a, const ArrayXX& b)
+void Vvt::jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
 {
-    return ArrayXX::Constant(a.rows(), 1, 1).matrix() * b.matrix();
+    out.matrix().noalias() = tangentA.matrix() * b.matrix();
+    out.matrix().noalias() += a.matrix() * tangentB.matrix();
 }
 
-ArrayXX Vvt::differentiateWrtB(const ArrayXX& a, const ArrayXX& b)
+void Vvt::vjpA(const ConstArrayRef&, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return a.matrix() * ArrayXX::Constant(1, b.cols(), 1).matrix();
+    // back = a.rows x b.cols
+    // out is a.rows x 1
+    out.matrix().noalias() = back.matrix() * b.matrix().transpose();
 }
 
-ArrayXX Vvt::chainA(const ArrayXX& back, const ArrayXX& dA)
+void Vvt::vjpTangentA(const ConstArrayRef&, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef&, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    // back = a.rows x b.cols
-    // dA =        - " -
-    // ret is a.rows x 1
-    ArrayXX ret =  (back * dA).rowwise().sum();
-    return ret;
+    out.matrix().noalias() = tangentBack.matrix() * b.matrix().transpose();
+    out.matrix().noalias() += back.matrix() * tangentB.matrix().transpose();
 }
 
-ArrayXX Vvt::chainB(const ArrayXX& back, const ArrayXX& dB)
+void Vvt::vjpB(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
     // back = a.rows x b.cols
-    // dB =        - " -
-    // ret is 1 x b.cols
-    ArrayXX ret =  (back * dB).colwise().sum();
-    return ret;
+    // out is 1 x b.cols
+    out.matrix().noalias() = a.matrix().transpose() * back.matrix();
+}
+
+void Vvt::vjpTangentB(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    out.matrix().noalias() = a.matrix().transpose() * tangentBack.matrix();
+    out.matrix().noalias() += tangentA.matrix().transpose() * back.matrix();
+}
+
+void MatMul::eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
+{
+    out.matrix().noalias() = a.matrix() * b.matrix();
+}
+
+void MatMul::jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out)
+{
+    out.matrix().noalias() = tangentA.matrix() * b.matrix();
+    out.matrix().noalias() += a.matrix() * tangentB.matrix();
 }
 
-ArrayXX MatMul::eval(const ArrayXX& a, const ArrayXX& b)
+void MatMul::vjpA(const ConstArrayRef&, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return a.matrix() * b.matrix();
+    out.matrix().noalias() = back.matrix() * b.matrix().transpose();
 }
 
-ArrayXX MatMul::differentiateWrtA(const ArrayXX&, const ArrayXX& b)
+void MatMul::vjpTangentA(const ConstArrayRef&, const ConstArrayRef& b, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef&, const ConstArrayRef& tangentB, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return b;
+    out.matrix().noalias() = tangentBack.matrix() * b.matrix().transpose();
+    out.matrix().noalias() += back.matrix() * tangentB.matrix().transpose();
 }
 
-ArrayXX MatMul::differentiateWrtB(const ArrayXX& a, const ArrayXX&)
+void MatMul::vjpB(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return a;
+    out.matrix().noalias() = a.matrix().transpose() * back.matrix();
 }
 
-ArrayXX MatMul::chainA(const ArrayXX& back, const ArrayXX& dA)
+void MatMul::vjpTangentB(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return back.matrix() * dA.matrix().transpose();
+    out.matrix().noalias() = a.matrix().transpose() * tangentBack.matrix();
+    out.matrix().noalias() += tangentA.matrix().transpose() * back.matrix();
 }
 
-ArrayXX MatMul::chainB(const ArrayXX& back, const ArrayXX& dB)
+void ReduceSum::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
 {
-    return dB.matrix().transpose() * back.matrix();
+    out(0, 0) = a.sum();
 }
 
-ArrayXX ReduceSum::eval(const ArrayXX& a, const ArrayXX&)
+void ReduceSum::jvp(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
 {
-    return ArrayXX::Constant(1, 1, a.sum());
+    out(0, 0) = tangentA.sum();
 }
 
-ArrayXX ReduceSum::chainA(const ArrayXX& back, const ArrayXX& dA)
+void ReduceSum::vjpA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
     // back is 1 x 1
-    // dA is n x m
-    // ret is n x m
+    // out is n x m
     Q_ASSERT(back.size() == 1);
-    return dA * back(0, 0);
+    out.setConstant(back(0, 0));
 }
 
-ArrayXX ReduceProd::eval(const ArrayXX& a, const ArrayXX&)
+void ReduceSum::vjpTangentA(const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
 {
-    return ArrayXX::Constant(1, 1, a.prod());
+    out.setConstant(tangentBack(0, 0));
 }
 
-ArrayXX ReduceProd::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void ReduceProd::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
 {
-    return ArrayXX::Constant(a.rows(), a.cols(), a.prod()) / a;
+    out(0, 0) = a.prod();
 }
 
-ArrayXX ReduceProd::chainA(const ArrayXX& back, const ArrayXX& dA)
+void ReduceProd::jvp(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
+{
+    out(0, 0) = (result(0, 0) * tangentA / a).sum();
+}
+
+void ReduceProd::vjpA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
 {
     // back is 1 x 1
-    // dA is n x m
-    // ret is n x m
+    // out is n x m
     Q_ASSERT(back.size() == 1);
-    return dA * back(0, 0);
+    out = (back(0, 0) * result(0, 0)) / a;
 }
 
-ArrayXX Relu::eval(const ArrayXX& a, const ArrayXX&)
+void ReduceProd::vjpTangentA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef&, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    const float scale = back(0, 0) * result(0, 0);
+    out = (tangentBack(0, 0) * result(0, 0) + back(0, 0) * tangentResult(0, 0) - scale * tangentA / a) / a;
+}
+
+void Relu::eval(const ConstArrayRef& a, const ConstArrayRef&, ArrayRef out)
 {
 //	std::cout << "relu input: " << a.transpose() << std::endl;
-    return a.max(a * 0.01f);
+    out = a.max(a * 0.01f);
+}
+
+void Relu::jvp(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentA, const ConstArrayRef&, ArrayRef out)
+{
+    out = tangentA * ((a > 0.f).cast<float>() * 0.99f + 0.01f);
+}
+
+void Relu::vjpA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
+{
+    out = back * ((a > 0.f).cast<float>() * 0.99f + 0.01f);
+}
+
+void Relu::vjpTangentA(const ConstArrayRef& a, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    // the slope is piecewise constant
+    out = tangentBack * ((a > 0.f).cast<float>() * 0.99f + 0.01f);
+}
+
+void Sum::evalN(const Operands& x, ArrayRef out)
+{
+    // out may share its storage with an operand (in-place evaluation), that one is taken first
+    size_t first = 0;
+    for (size_t k = 0; k < x.size(); ++k) {
+        if (x[k].data() == out.data())
+            first = k;
+    }
+    expand(x[first], out.rows(), out.cols(), AssignKernel{out});
+    for (size_t k = 0; k < x.size(); ++k) {
+        if (k != first)
+            expand(x[k], out.rows(), out.cols(), AccumulateKernel{out});
+    }
 }
 
-ArrayXX Relu::differentiateWrtA(const ArrayXX& a, const ArrayXX&)
+void Sum::vjpN(int, const Operands&, const ConstArrayRef&, const ConstArrayRef& back, ArrayRef out)
 {
-    return (a > 0.f).cast<float>() * 0.99 + 0.01;
+    reduceTo(back, out);
 }
 
+void Sum::vjpTangentN(int, const Operands&, const ConstArrayRef&, const ConstArrayRef&, const Operands&, const ConstArrayRef&, const ConstArrayRef& tangentBack, ArrayRef out)
+{
+    reduceTo(tangentBack, out);
 }
 
+void Sum::jvpN(const Operands&, const ConstArrayRef&, const Operands& tangents, ArrayRef out)
+{
+    evalN(tangents, out);
+}
 
+Size Sum::outSizeN(const std::vector<Size>& sizes)
+{
+    Size out = sizes.front();
+    for (const auto& size : sizes)
+        out = g_add.outSize(out, size);
+    return out;
+}
+
+Ptr fromOpcode(Opcode opcode)
+{
+    static const Ptr operators[] = {
+        &g_add,
+        &g_subtract,
+        &g_mul,
+        &g_div,
+        &g_log,
+        &g_exp,
+        &g_normExp,
+        &g_relu,
+        &g_vvt,
+        &g_matMul,
+        &g_reduceSum,
+        &g_reduceProd,
+        &g_sum,
+    };
+    static_assert(sizeof(operators) / sizeof(operators[0]) == size_t(Opcode::Count), "one operator per opcode");
+    Q_ASSERT(opcode < Opcode::Count);
+    return operators[size_t(opcode)];
+}
+
+// qualified calls are bound statically, the compiler sees through them
+void eval(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out)
+{
+    switch (opcode) {
+    case Opcode::Add: g_add.Add::eval(a, b, out); return;
+    case Opcode::Subtract: g_subtract.Subtract::eval(a, b, out); return;
+    case Opcode::Mul: g_mul.Mul::eval(a, b, out); return;
+    case Opcode::Div: g_div.Div::eval(a, b, out); return;
+    case Opcode::Log: g_log.Log::eval(a, b, out); return;
+    case Opcode::Exp: g_exp.Exp::eval(a, b, out); return;
+    case Opcode::NormExp: g_normExp.NormExp::eval(a, b, out); return;
+    case Opcode::Relu: g_relu.Relu::eval(a, b, out); return;
+    case Opcode::Vvt: g_vvt.Vvt::eval(a, b, out); return;
+    case Opcode::MatMul: g_matMul.MatMul::eval(a, b, out); return;
+    case Opcode::ReduceSum: g_reduceSum.ReduceSum::eval(a, b, out); return;
+    case Opcode::ReduceProd: g_reduceProd.ReduceProd::eval(a, b, out); return;
+    case Opcode::Sum:
+    case Opcode::Count: break;
+    }
+    Q_ASSERT(false);
+}
+
+void vjpA(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    switch (opcode) {
+    case Opcode::Add: g_add.Add::vjpA(a, b, result, back, out); return;
+    case Opcode::Subtract: g_subtract.Subtract::vjpA(a, b, result, back, out); return;
+    case Opcode::Mul: g_mul.Mul::vjpA(a, b, result, back, out); return;
+    case Opcode::Div: g_div.Div::vjpA(a, b, result, back, out); return;
+    case Opcode::Log: g_log.Log::vjpA(a, b, result, back, out); return;
+    case Opcode::Exp: g_exp.Exp::vjpA(a, b, result, back, out); return;
+    case Opcode::NormExp: g_normExp.NormExp::vjpA(a, b, result, back, out); return;
+    case Opcode::Relu: g_relu.Relu::vjpA(a, b, result, back, out); return;
+    case Opcode::Vvt: g_vvt.Vvt::vjpA(a, b, result, back, out); return;
+    case Opcode::MatMul: g_matMul.MatMul::vjpA(a, b, result, back, out); return;
+    case Opcode::ReduceSum: g_reduceSum.ReduceSum::vjpA(a, b, result, back, out); return;
+    case Opcode::ReduceProd: g_reduceProd.ReduceProd::vjpA(a, b, result, back, out); return;
+    case Opcode::Sum:
+    case Opcode::Count: break;
+    }
+    Q_ASSERT(false);
+}
+
+void vjpB(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out)
+{
+    switch (opcode) {
+    case Opcode::Add: g_add.Add::vjpB(a, b, result, back, out); return;
+    case Opcode::Subtract: g_subtract.Subtract::vjpB(a, b, result, back, out); return;
+    case Opcode::Mul: g_mul.Mul::vjpB(a, b, result, back, out); return;
+    case Opcode::Div: g_div.Div::vjpB(a, b, result, back, out); return;
+    case Opcode::Log: g_log.Log::vjpB(a, b, result, back, out); return;
+    case Opcode::Exp: g_exp.Exp::vjpB(a, b, result, back, out); return;
+    case Opcode::NormExp: g_normExp.NormExp::vjpB(a, b, result, back, out); return;
+    case Opcode::Relu: g_relu.Relu::vjpB(a, b, result, back, out); return;
+    case Opcode::Vvt: g_vvt.Vvt::vjpB(a, b, result, back, out); return;
+    case Opcode::MatMul: g_matMul.MatMul::vjpB(a, b, result, back, out); return;
+    case Opcode::ReduceSum: g_reduceSum.ReduceSum::vjpB(a, b, result, back, out); return;
+    case Opcode::ReduceProd: g_reduceProd.ReduceProd::vjpB(a, b, result, back, out); return;
+    case Opcode::Sum:
+    case Opcode::Count: break;
+    }
+    Q_ASSERT(false);
+}
+}
@@ -30,110 +30,252 @@
 #ifndef OPERATORS_H
 #define OPERATORS_H
 
+#include <cstdint>
 #include <memory>
+#include <vector>
 #include "Eigen/Core"
 
 using ArrayXX = Eigen::ArrayXXf;
+using ArrayRef = Eigen::Ref<ArrayXX>;
+using ConstArrayRef = Eigen::Ref<const ArrayXX>;
 using Size = Eigen::Vector2i;
 
 namespace operators {
+// the values of all operands of a node, in order
+using Operands = std::vector<Eigen::Map<const ArrayXX>>;
+
+// identifies the operator without a virtual call. append only, the values are part of the serialization format.
+enum class Opcode : uint8_t {
+    Add, Subtract, Mul, Div, Log, Exp, NormExp, Relu, Vvt, MatMul, ReduceSum, ReduceProd, Sum,
+    Count
+};
+
+// operators with one or two operands implement the members taking a and b. unary operators get their
+// operand as both a and b and ignore b. the n-ary members below are what Expression and Plan call, their
+// defaults forward to the binary ones. variadic operators (arity() == -1) implement the n-ary members only.
 struct Base {
+    explicit Base(Opcode opcode, int arity = 2) : m_opcode(opcode), m_arity(arity) {}
     virtual ~Base() = default;
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) = 0;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b);
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b);
-    virtual ArrayXX chainA(const ArrayXX& back, const ArrayXX& dA);
-    virtual ArrayXX chainB(const ArrayXX& back, const ArrayXX& dB);
+    // plain members, the compiled executor (Plan) reads them for every instruction
+    Opcode opcode() const { return m_opcode; }
+    // number of operands, -1 for any number
+    int arity() const { return m_arity; }
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) = 0;
+    // vector jacobian products: map the adjoint of the result (back) to the adjoint of a resp. b.
+    // out has the size of a resp. b. the defaults pass back through unchanged.
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out);
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out);
+    // directional derivatives of vjpA resp. vjpB along the tangents of all their arguments, for forward over reverse
+    // differentiation (hessian vector products). the defaults match the default vjps.
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out);
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out);
+    // jacobian vector product: maps the tangents of a and b to the tangent of the result (out).
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) = 0;
     virtual Size outSize(const Size& sizeA, const Size& sizeB);
+
+    // same as above, k is the position of the operand
+    virtual void evalN(const Operands& x, ArrayRef out);
+    virtual void vjpN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out);
+    virtual void vjpTangentN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, const Operands& tangents, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out);
+    virtual void jvpN(const Operands& x, const ConstArrayRef& result, const Operands& tangents, ArrayRef out);
+    virtual Size outSizeN(const std::vector<Size>& sizes);
+
+    // result(i) depends on the i-th element of the operands only
+    virtual bool elementwise() const { return false; }
+    virtual bool commutative() const { return false; }
+    // whether the vjp members read the operands or the result. values that the backward pass doesn't read
+    // can be overwritten as soon as the forward pass is done with them, see Plan.
+    virtual bool vjpReadsOperands() const { return true; }
+    virtual bool vjpReadsResult() const { return true; }
+
+private:
+    Opcode m_opcode;
+    int m_arity;
 };
 struct UnaryBase : public Base {
-    virtual ArrayXX chainB(const ArrayXX& back, const ArrayXX& dB);
-    virtual Size outSize(const Size& sizeA, const Size& sizeB);
+    explicit UnaryBase(Opcode opcode) : Base(opcode, 1) {}
+    virtual Size outSize(const Size& sizeA, const Size& sizeB) override;
+};
+struct VariadicBase : public Base {
+    explicit VariadicBase(Opcode opcode) : Base(opcode, -1) {}
+    // not used, see Base
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+};
+// binary element wise operators with numpy style broadcasting: along each dimension an operand either has
+// the size of the result or size 1 and is repeated. so scalars, columns (rows x 1) and rows (1 x cols) are
+// broadcast, the adjoint of an operand is the sum over all elements it was repeated to.
+struct ElementwiseBase : public Base {
+    explicit ElementwiseBase(Opcode opcode) : Base(opcode) {}
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual Size outSize(const Size& sizeA, const Size& sizeB) override;
+    virtual bool elementwise() const override { return true; }
 };
 using Ptr = Base*;
 
-struct Add : public Base {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override { return a + b; }
+struct Add : public ElementwiseBase {
+    Add() : ElementwiseBase(Opcode::Add) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual bool commutative() const override { return true; }
+    virtual bool vjpReadsOperands() const override { return false; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Add g_add;
 
-struct Subtract : public Base {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override { return a - b; }
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b) override;
+struct Subtract : public ElementwiseBase {
+    Subtract() : ElementwiseBase(Opcode::Subtract) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool vjpReadsOperands() const override { return false; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Subtract g_subtract;
 
-struct Mul : public Base {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override { return a * b; }
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b) override;
+struct Mul : public ElementwiseBase {
+    Mul() : ElementwiseBase(Opcode::Mul) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool commutative() const override { return true; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Mul g_mul;
 
-struct Div : public Base {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override { return a / b; }
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b) override;
+struct Div : public ElementwiseBase {
+    Div() : ElementwiseBase(Opcode::Div) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Div g_div;
 
 struct Log : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
+    Log() : UnaryBase(Opcode::Log) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool elementwise() const override { return true; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Log g_log;
 
 struct Exp : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
+    Exp() : UnaryBase(Opcode::Exp) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool elementwise() const override { return true; }
+    virtual bool vjpReadsOperands() const override { return false; }
 };
 extern Exp g_exp;
 
 struct NormExp : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
+    NormExp() : UnaryBase(Opcode::NormExp) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool vjpReadsOperands() const override { return false; }
 };
 extern NormExp g_normExp;
 
 struct Vvt : public Base { // vector vector.transpose
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX chainA(const ArrayXX& back, const ArrayXX& dA) override;
-    virtual ArrayXX chainB(const ArrayXX& back, const ArrayXX& dB) override;
+    Vvt() : Base(Opcode::Vvt) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Vvt g_vvt;
 
 
-struct MatMul : public Base { // vector vector.transpose
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtB(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX chainA(const ArrayXX& back, const ArrayXX& dA) override;
-    virtual ArrayXX chainB(const ArrayXX& back, const ArrayXX& dB) override;
+struct MatMul : public Base {
+    MatMul() : Base(Opcode::MatMul) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void vjpB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentB(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern MatMul g_matMul;
 
 struct ReduceSum : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX chainA(const ArrayXX& back, const ArrayXX& dA) override;
+    ReduceSum() : UnaryBase(Opcode::ReduceSum) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
     virtual Size outSize(const Size&, const Size&) override { return {1, 1}; }
+    virtual bool vjpReadsOperands() const override { return false; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern ReduceSum g_reduceSum;
 
 struct ReduceProd : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX chainA(const ArrayXX& back, const ArrayXX& dA) override;
+    ReduceProd() : UnaryBase(Opcode::ReduceProd) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
     virtual Size outSize(const Size&, const Size&) override { return {1, 1}; }
 };
 extern ReduceProd g_reduceProd;
 
 struct Relu : public UnaryBase {
-    virtual ArrayXX eval(const ArrayXX& a, const ArrayXX& b) override;
-    virtual ArrayXX differentiateWrtA(const ArrayXX& a, const ArrayXX& b) override;
+    Relu() : UnaryBase(Opcode::Relu) {}
+    virtual void eval(const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out) override;
+    virtual void jvp(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, ArrayRef out) override;
+    virtual void vjpA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentA(const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, const ConstArrayRef& tangentA, const ConstArrayRef& tangentB, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual bool elementwise() const override { return true; }
+    virtual bool vjpReadsResult() const override { return false; }
 };
 extern Relu g_relu;
+
+// sum of any number of operands, element wise. operands are broadcast as with Add.
+struct Sum : public VariadicBase {
+    Sum() : VariadicBase(Opcode::Sum) {}
+    virtual void evalN(const Operands& x, ArrayRef out) override;
+    virtual void vjpN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out) override;
+    virtual void vjpTangentN(int k, const Operands& x, const ConstArrayRef& result, const ConstArrayRef& back, const Operands& tangents, const ConstArrayRef& tangentResult, const ConstArrayRef& tangentBack, ArrayRef out) override;
+    virtual void jvpN(const Operands& x, const ConstArrayRef& result, const Operands& tangents, ArrayRef out) override;
+    virtual Size outSizeN(const std::vector<Size>& sizes) override;
+    virtual bool elementwise() const override { return true; }
+    virtual bool commutative() const override { return true; }
+    virtual bool vjpReadsOperands() const override { return false; }
+    virtual bool vjpReadsResult() const override { return false; }
+};
+extern Sum g_sum;
+
+// the operator with the given opcode
+Ptr fromOpcode(Opcode opcode);
+
+// the same as the virtual members, but dispatched by a switch over the opcode that calls the implementations
+// directly. used by the compiled executor (Plan), where the opcode of every instruction is known up front.
+// for operators with at most two operands.
+void eval(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, ArrayRef out);
+void vjpA(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out);
+void vjpB(Opcode opcode, const ConstArrayRef& a, const ConstArrayRef& b, const ConstArrayRef& result, const ConstArrayRef& back, ArrayRef out);
 }
 
 #endif // OPERATORS_H
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "passes.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <tuple>
+#include <unordered_map>
+
+#include <QtGlobal>
+
+#include "operators.h"
+
+namespace {
+struct NodeKey {
+    operators::Ptr op;
+    std::vector<Expression*> operands;
+    bool operator==(const NodeKey& other) const { return std::tie(op, operands) == std::tie(other.op, other.operands); }
+};
+struct NodeKeyHash {
+    size_t operator()(const NodeKey& key) const {
+        std::hash<const void*> hash;
+        size_t h = hash(key.op);
+        for (auto operand : key.operands)
+            h = h * 31 ^ hash(operand);
+        return h;
+    }
+};
+
+size_t contentHash(const ArrayXX& value)
+{
+    size_t hash = std::hash<Eigen::Index>()(value.rows()) * 31 + std::hash<Eigen::Index>()(value.cols());
+    for (Eigen::Index i = 0; i < value.size(); ++i) {
+        uint32_t bits;
+        std::memcpy(&bits, value.data() + i, sizeof(bits));
+        hash = hash * 1000003 ^ bits;
+    }
+    return hash;
+}
+
+bool sameContent(const ArrayXX& a, const ArrayXX& b)
+{
+    return a.rows() == b.rows() && a.cols() == b.cols()
+            && std::memcmp(a.data(), b.data(), sizeof(float) * size_t(a.size())) == 0;
+}
+
+// owning pointers of all nodes, whether they are constants that may change (see passes.h) and how often
+// they are used inside of the graph
+struct GraphInfo {
+    std::unordered_map<Expression*, ExpressionPtr> pointers;
+    std::unordered_map<Expression*, bool> pinned;
+    std::unordered_map<Expression*, long> uses;
+};
+
+GraphInfo analyse(const ExpressionPtr& root, const passes::Nodes& inputs)
+{
+    const auto& tape = root->tape();
+    std::unordered_map<Expression*, long> uses;
+    for (auto node : tape) {
+        for (const auto& child : node->operands())
+            ++uses[child.get()];
+    }
+    GraphInfo info;
+    for (auto node : tape) {
+        auto leaf = dynamic_cast<const Variable*>(node);
+        info.pinned[node] = leaf && (leaf->isMutable() || inputs.count(node));
+    }
+    for (auto node : tape) {
+        for (const auto& child : node->operands())
+            info.pointers[child.get()] = child;
+    }
+    info.pointers[root.get()] = root;
+    info.uses = std::move(uses);
+    return info;
+}
+
+// whether node is a constant of the graph with all elements equal to v
+bool isUniform(const ExpressionPtr& node, const GraphInfo& info, float v)
+{
+    auto constant = dynamic_cast<const Constant*>(node.get());
+    auto pinned = info.pinned.find(node.get());
+    return constant && pinned != info.pinned.end() && !pinned->second && (constant->value() == v).all();
+}
+
+// x for 0 - x, nullptr otherwise
+ExpressionPtr negated(const ExpressionPtr& node, const GraphInfo& info)
+{
+    if (node->op() != &operators::g_subtract)
+        return nullptr;
+    const auto& x = node->operands();
+    return isUniform(x[0], info, 0) && x[1]->size() == node->size() ? x[1] : nullptr;
+}
+
+// v for an outer product of the vector v with a vector of ones, nullptr otherwise
+ExpressionPtr repeated(const ExpressionPtr& node, const GraphInfo& info)
+{
+    if (node->op() != &operators::g_matMul)
+        return nullptr;
+    const auto& x = node->operands();
+    if (x[0]->size()(1) == 1 && isUniform(x[1], info, 1))
+        return x[0];
+    if (x[1]->size()(0) == 1 && isUniform(x[0], info, 1))
+        return x[1];
+    return nullptr;
+}
+
+// applies the first matching rule to a node with the given operator and operands. nullptr if none matches.
+ExpressionPtr rewrite(operators::Ptr op, const std::vector<ExpressionPtr>& x, const Size& size, const GraphInfo& info)
+{
+    using namespace operators;
+    auto fits = [&](size_t k) { return x[k]->size() == size; };
+    if (op == &g_log && x[0]->op() == &g_exp)
+        return x[0]->operands()[0];
+    if (op == &g_matMul) {
+        for (size_t k : {0, 1}) {
+            if (x[k]->size().prod() != 1)
+                continue;
+            if (isUniform(x[k], info, 1))
+                return x[1 - k];
+            return std::make_shared<Expression>(x[0], x[1], &g_mul);
+        }
+    }
+    if (op == &g_add || op == &g_mul) {
+        for (size_t k : {0, 1}) {
+            if (isUniform(x[k], info, op == &g_add ? 0 : 1) && fits(1 - k))
+                return x[1 - k];
+        }
+    }
+    if (((op == &g_subtract && isUniform(x[1], info, 0)) || (op == &g_div && isUniform(x[1], info, 1))) && fits(0))
+        return x[0];
+    if (op == &g_add || op == &g_subtract) {
+        // a + (0 - b) = a - b, (0 - a) + b = b - a, a - (0 - b) = a + b
+        if (auto b = negated(x[1], info))
+            return std::make_shared<Expression>(x[0], b, op == &g_add ? static_cast<Ptr>(&g_subtract) : &g_add);
+        if (op == &g_add) {
+            if (auto a = negated(x[0], info))
+                return std::make_shared<Expression>(x[1], a, &g_subtract);
+        }
+    }
+    if (op->elementwise() && op->arity() != 1) {
+        // element wise operators broadcast vectors by themselves
+        for (size_t k = 0; k < x.size(); ++k) {
+            auto v = repeated(x[k], info);
+            if (!v)
+                continue;
+            std::vector<ExpressionPtr> operands = x;
+            operands[k] = v;
+            std::vector<Size> sizes;
+            for (const auto& operand : operands)
+                sizes.push_back(operand->size());
+            if (op->outSizeN(sizes) == size)
+                return std::make_shared<Expression>(std::move(operands), op);
+        }
+    }
+    return nullptr;
+}
+
+// a matrix product whose result only feeds another matrix product is part of that one's chain
+bool inChain(const ExpressionPtr& node, const GraphInfo& info)
+{
+    return node->op() == &operators::g_matMul && info.uses.at(node.get()) == 1;
+}
+
+// the factors of the chain ending in node from left to right, and the flops of its current order
+struct Chain {
+    std::vector<ExpressionPtr> factors;
+    std::vector<bool> requiresGradient;
+    double flops = 0;
+};
+
+void collectChain(const ExpressionPtr& node, const GraphInfo& info, const std::unordered_map<Expression*, ExpressionPtr>& replacement,
+                  const std::unordered_map<Expression*, bool>& requiresGradient, Chain& chain)
+{
+    const auto& x = node->operands();
+    const double product = double(x[0]->size()(0)) * double(x[0]->size()(1)) * double(x[1]->size()(1));
+    chain.flops += product * (1 + requiresGradient.at(x[0].get()) + requiresGradient.at(x[1].get()));
+    for (const auto& operand : x) {
+        if (inChain(operand, info)) {
+            collectChain(operand, info, replacement, requiresGradient, chain);
+            continue;
+        }
+        chain.factors.push_back(replacement.at(operand.get()));
+        chain.requiresGradient.push_back(requiresGradient.at(operand.get()));
+    }
+}
+
+std::vector<ExpressionPtr> replaced(const std::vector<ExpressionPtr>& operands, const std::unordered_map<Expression*, ExpressionPtr>& replacement)
+{
+    std::vector<ExpressionPtr> result;
+    for (const auto& operand : operands)
+        result.push_back(replacement.at(operand.get()));
+    return result;
+}
+}
+
+ExpressionPtr passes::eliminateCommonSubexpressions(const ExpressionPtr& root, const Nodes& inputs)
+{
+    GraphInfo info = analyse(root, inputs);
+    std::unordered_map<Expression*, ExpressionPtr> replacement;
+    std::unordered_map<NodeKey, ExpressionPtr, NodeKeyHash> nodes;
+    std::unordered_multimap<size_t, ExpressionPtr> constants;
+
+    // post order, children are replaced before their parents
+    const auto& tape = root->tape();
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        const ExpressionPtr& self = info.pointers.at(node);
+        if (!node->op()) {
+            auto constant = dynamic_cast<const Constant*>(node);
+            if (!constant || info.pinned.at(node)) {
+                replacement[node] = self;
+                continue;
+            }
+            const size_t hash = contentHash(constant->value());
+            auto range = constants.equal_range(hash);
+            auto match = std::find_if(range.first, range.second, [&](const std::pair<const size_t, ExpressionPtr>& candidate) {
+                return sameContent(std::static_pointer_cast<const Variable>(candidate.second)->value(), constant->value());
+            });
+            if (match != range.second) {
+                replacement[node] = match->second;
+            }
+            else {
+                constants.emplace(hash, self);
+                replacement[node] = self;
+            }
+            continue;
+        }
+
+        const std::vector<ExpressionPtr> operands = replaced(node->operands(), replacement);
+        NodeKey key = {node->op(), {}};
+        for (const auto& operand : operands)
+            key.operands.push_back(operand.get());
+        if (node->op()->commutative())
+            std::sort(key.operands.begin(), key.operands.end(), std::less<Expression*>());
+        auto match = nodes.find(key);
+        if (match != nodes.end()) {
+            replacement[node] = match->second;
+            continue;
+        }
+        ExpressionPtr merged = operands == node->operands() ? self : std::make_shared<Expression>(operands, node->op());
+        nodes.emplace(key, merged);
+        replacement[node] = merged;
+    }
+    return replacement.at(root.get());
+}
+
+ExpressionPtr passes::foldConstants(const ExpressionPtr& root, const Nodes& inputs)
+{
+    GraphInfo info = analyse(root, inputs);
+    std::unordered_map<Expression*, ExpressionPtr> replacement;
+    std::unordered_map<Expression*, bool> constant;
+
+    const auto& tape = root->tape();
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        const ExpressionPtr& self = info.pointers.at(node);
+        if (!node->op()) {
+            constant[node] = dynamic_cast<Constant*>(node) && !info.pinned.at(node);
+            replacement[node] = self;
+            continue;
+        }
+
+        const std::vector<ExpressionPtr> operands = replaced(node->operands(), replacement);
+        bool foldable = node != root.get();
+        for (const auto& operand : node->operands())
+            foldable = foldable && constant.at(operand.get());
+        if (foldable) {
+            operators::Operands x;
+            std::vector<Size> sizes;
+            for (const auto& operand : operands) {
+                const auto& value = std::static_pointer_cast<const Variable>(operand)->value();
+                x.emplace_back(value.data(), value.rows(), value.cols());
+                sizes.emplace_back(value.rows(), value.cols());
+            }
+            const Size size = node->op()->outSizeN(sizes);
+            ArrayXX value(size(0), size(1));
+            node->op()->evalN(x, value);
+            constant[node] = true;
+            replacement[node] = Constant::make(std::move(value));
+            continue;
+        }
+        constant[node] = false;
+        replacement[node] = operands == node->operands() ? self : std::make_shared<Expression>(operands, node->op());
+    }
+    return replacement.at(root.get());
+}
+
+ExpressionPtr passes::simplify(const ExpressionPtr& root, const Nodes& inputs)
+{
+    GraphInfo info = analyse(root, inputs);
+    std::unordered_map<Expression*, ExpressionPtr> replacement;
+
+    const auto& tape = root->tape();
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        const ExpressionPtr& self = info.pointers.at(node);
+        if (!node->op()) {
+            replacement[node] = self;
+            continue;
+        }
+
+        const std::vector<ExpressionPtr> operands = replaced(node->operands(), replacement);
+        ExpressionPtr result = operands == node->operands() ? self : std::make_shared<Expression>(operands, node->op());
+        // a rewritten node may match further rules. every rule removes a node or replaces a matrix product,
+        // so this ends. the root stays an inner node.
+        while (result->op()) {
+            ExpressionPtr rewritten = rewrite(result->op(), result->operands(), result->size(), info);
+            if (!rewritten || (node == root.get() && !rewritten->op()))
+                break;
+            result = rewritten;
+        }
+        replacement[node] = result;
+    }
+    return replacement.at(root.get());
+}
+
+ExpressionPtr passes::reorderMatrixChains(const ExpressionPtr& root, const Nodes& inputs)
+{
+    GraphInfo info = analyse(root, inputs);
+    std::unordered_map<Expression*, ExpressionPtr> replacement;
+    std::unordered_map<Expression*, bool> requiresGradient;
+    std::unordered_map<Expression*, bool> absorbed;
+
+    const auto& tape = root->tape();
+    for (auto node : tape) {
+        if (node->op() == &operators::g_matMul) {
+            for (const auto& operand : node->operands())
+                absorbed[operand.get()] = inChain(operand, info);
+        }
+    }
+
+    for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+        Expression* node = *it;
+        const ExpressionPtr& self = info.pointers.at(node);
+        if (!node->op()) {
+            requiresGradient[node] = node->requiresGradient();
+            replacement[node] = self;
+            continue;
+        }
+        requiresGradient[node] = false;
+        for (const auto& operand : node->operands())
+            requiresGradient[node] = requiresGradient[node] || requiresGradient.at(operand.get());
+
+        const std::vector<ExpressionPtr> operands = replaced(node->operands(), replacement);
+        replacement[node] = operands == node->operands() ? self : std::make_shared<Expression>(operands, node->op());
+        if (node->op() != &operators::g_matMul || absorbed[node])
+            continue;
+        Chain chain;
+        collectChain(self, info, replacement, requiresGradient, chain);
+        const size_t n = chain.factors.size();
+        if (n < 3)
+            continue;
+
+        // flops[i][j] is the cost of the cheapest order for factors i to j, split[i][j] the last product there
+        std::vector<Eigen::Index> dims;
+        for (const auto& factor : chain.factors)
+            dims.push_back(factor->size()(0));
+        dims.push_back(chain.factors.back()->size()(1));
+        std::vector<std::vector<double>> flops(n, std::vector<double>(n, 0));
+        std::vector<std::vector<size_t>> split(n, std::vector<size_t>(n, 0));
+        std::vector<std::vector<bool>> gradient(n, std::vector<bool>(n, false));
+        for (size_t i = 0; i < n; ++i)
+            gradient[i][i] = chain.requiresGradient[i];
+        for (size_t length = 2; length <= n; ++length) {
+            for (size_t i = 0; i + length <= n; ++i) {
+                const size_t j = i + length - 1;
+                gradient[i][j] = gradient[i][j - 1] || chain.requiresGradient[j];
+                flops[i][j] = std::numeric_limits<double>::infinity();
+                for (size_t k = i; k < j; ++k) {
+                    const double product = double(dims[i]) * double(dims[k + 1]) * double(dims[j + 1]);
+                    const double cost = flops[i][k] + flops[k + 1][j] + product * (1 + gradient[i][k] + gradient[k + 1][j]);
+                    if (cost < flops[i][j]) {
+                        flops[i][j] = cost;
+                        split[i][j] = k;
+                    }
+                }
+            }
+        }
+        if (flops[0][n - 1] >= chain.flops)
+            continue;
+
+        std::function<ExpressionPtr(size_t, size_t)> build = [&](size_t i, size_t j) -> ExpressionPtr {
+            if (i == j)
+                return chain.factors[i];
+            return std::make_shared<Expression>(build(i, split[i][j]), build(split[i][j] + 1, j), &operators::g_matMul);
+        };
+        replacement[node] = build(0, n - 1);
+    }
+    return replacement.at(root.get());
+}
+
+ExpressionPtr passes::optimize(const ExpressionPtr& root, const Nodes& inputs)
+{
+    return eliminateCommonSubexpressions(reorderMatrixChains(simplify(foldConstants(root, inputs), inputs), inputs), inputs);
+}
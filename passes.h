@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PASSES_H
+#define PASSES_H
+
+#include <unordered_set>
+
+#include "Expression.h"
+
+// graph to graph rewrites. they return the root of an equivalent graph, which shares all nodes that
+// did not need to change with the input graph. variables are never replaced.
+//
+// constants whose value changes after the graph was built are left alone: those marked with
+// Variable::setMutable() (e.g. Net::input) and the given inputs.
+namespace passes {
+using Nodes = std::unordered_set<const Expression*>;
+
+// merges structurally identical subexpressions over the same inputs, and constants of equal value.
+ExpressionPtr eliminateCommonSubexpressions(const ExpressionPtr& root, const Nodes& inputs = Nodes());
+
+// evaluates subexpressions that depend on constants only once and replaces them by their value.
+// the root is never folded.
+ExpressionPtr foldConstants(const ExpressionPtr& root, const Nodes& inputs = Nodes());
+
+// rewrites patterns that do needless work into cheaper equivalents: log(exp(x)) to x, products with a 1x1
+// factor to scalings (by 1 to nothing), additions of 0 and multiplications by 1 to nothing, negations
+// (0 - x) into the enclosing addition or subtraction, and vectors repeated with an outer product of ones
+// into broadcasting operands.
+ExpressionPtr simplify(const ExpressionPtr& root, const Nodes& inputs = Nodes());
+
+// reassociates chains of matrix products, whose intermediate results have no other use, into the order
+// with the fewest flops (the textbook dynamic program for matrix chains). the vjp of a product costs as much
+// as the product per operand that needs a gradient, so backward is part of the cost.
+ExpressionPtr reorderMatrixChains(const ExpressionPtr& root, const Nodes& inputs = Nodes());
+
+// all of the above, in a sensible order
+ExpressionPtr optimize(const ExpressionPtr& root, const Nodes& inputs = Nodes());
+}
+
+#endif // PASSES_H
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "serialization.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+#include <QFile>
+#include <QtGlobal>
+
+#include "operators.h"
+
+namespace {
+const char magic[4] = {'T', 'U', 'W', 'G'};
+// 2: variadic operators (Sum), with their operand indices in the data section
+// 3: metadata
+const uint32_t version = 3;
+const uint64_t alignment = 64;
+
+enum Kind : uint8_t {
+    KindVariable = 0,
+    KindConstant = 1,
+    KindOperator = 2,
+};
+enum Flags : uint8_t {
+    FlagRequiresGradient = 1,
+    FlagCheckpoint = 2,
+};
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t nNodes;
+    uint32_t nRoots;
+    uint64_t dataOffset;
+    uint64_t fileSize;
+    uint32_t nMetadata;
+    uint32_t reserved;
+};
+static_assert(sizeof(Header) == 40, "the header is part of the file format");
+
+struct NodeRecord {
+    uint8_t kind;
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t a;         // operands, for operators
+    uint32_t b;
+    int32_t rows;
+    int32_t cols;
+    uint32_t reserved2;
+    uint64_t data;      // offset of the value relative to the data section, for leaves
+};
+static_assert(sizeof(NodeRecord) == 32, "node records are part of the file format");
+
+struct RootRecord {
+    uint32_t node;
+    char name[60];
+};
+static_assert(sizeof(RootRecord) == 64, "root records are part of the file format");
+
+struct MetadataRecord {
+    float value;
+    char name[60];
+};
+static_assert(sizeof(MetadataRecord) == 64, "metadata records are part of the file format");
+
+uint64_t aligned(uint64_t offset)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// copies the records to cursor and returns the position after them. an empty vector may have no storage,
+// memcpy must not see its data() then.
+template<typename Record>
+char* append(char* cursor, const std::vector<Record>& records)
+{
+    if (!records.empty())
+        std::memcpy(cursor, records.data(), sizeof(Record) * records.size());
+    return cursor + sizeof(Record) * records.size();
+}
+
+// whether size bytes at offset are inside of the file. each term is checked on its own, so that
+// corrupt offsets can't wrap around.
+bool inFile(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+    return offset <= fileSize && size <= fileSize - offset;
+}
+}
+
+bool serialization::save(const QString& path, const NamedExpressions& roots, const Metadata& metadata)
+{
+    // children get their index before their parents
+    std::vector<Expression*> nodes;
+    std::unordered_map<Expression*, uint32_t> indexOf;
+    for (const auto& root : roots) {
+        const auto& tape = root.second->tape();
+        for (auto it = tape.rbegin(); it != tape.rend(); ++it) {
+            if (indexOf.emplace(*it, uint32_t(nodes.size())).second)
+                nodes.push_back(*it);
+        }
+    }
+
+    std::vector<NodeRecord> records(nodes.size());
+    uint64_t dataSize = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        Expression* node = nodes[i];
+        NodeRecord& record = records[i];
+        std::memset(&record, 0, sizeof(record));
+        record.rows = int32_t(node->rows());
+        record.cols = int32_t(node->cols());
+        record.flags = uint8_t((node->requiresGradient() ? FlagRequiresGradient : 0) | (node->isCheckpoint() ? FlagCheckpoint : 0));
+        if (node->op()) {
+            record.kind = KindOperator;
+            record.opcode = uint8_t(node->op()->opcode());
+            const auto& operands = node->operands();
+            if (node->op()->arity() < 0) {
+                // the operand indices of variadic operators go to the data section
+                record.a = uint32_t(operands.size());
+                record.data = dataSize;
+                dataSize = aligned(dataSize + sizeof(uint32_t) * operands.size());
+            }
+            else {
+                // unary operators repeat their operand
+                record.a = indexOf.at(operands.front().get());
+                record.b = indexOf.at(operands.back().get());
+            }
+        }
+        else {
+            record.kind = dynamic_cast<Constant*>(node) ? KindConstant : KindVariable;
+            record.data = dataSize;
+            dataSize = aligned(dataSize + sizeof(float) * uint64_t(node->rows() * node->cols()));
+        }
+    }
+    std::vector<RootRecord> rootRecords(roots.size());
+    for (size_t i = 0; i < roots.size(); ++i) {
+        Q_ASSERT(roots[i].first.size() < sizeof(RootRecord::name));
+        std::memset(&rootRecords[i], 0, sizeof(RootRecord));
+        rootRecords[i].node = indexOf.at(roots[i].second.get());
+        std::strncpy(rootRecords[i].name, roots[i].first.c_str(), sizeof(RootRecord::name) - 1);
+    }
+    std::vector<MetadataRecord> metadataRecords(metadata.size());
+    for (size_t i = 0; i < metadata.size(); ++i) {
+        Q_ASSERT(metadata[i].first.size() < sizeof(MetadataRecord::name));
+        std::memset(&metadataRecords[i], 0, sizeof(MetadataRecord));
+        metadataRecords[i].value = metadata[i].second;
+        std::strncpy(metadataRecords[i].name, metadata[i].first.c_str(), sizeof(MetadataRecord::name) - 1);
+    }
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.nNodes = uint32_t(nodes.size());
+    header.nRoots = uint32_t(roots.size());
+    header.nMetadata = uint32_t(metadata.size());
+    header.dataOffset = aligned(sizeof(Header) + sizeof(NodeRecord) * records.size() + sizeof(RootRecord) * rootRecords.size()
+                                + sizeof(MetadataRecord) * metadataRecords.size());
+    header.fileSize = header.dataOffset + dataSize;
+
+    std::vector<char> buffer(header.fileSize, 0);
+    char* cursor = buffer.data();
+    std::memcpy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+    cursor = append(cursor, records);
+    cursor = append(cursor, rootRecords);
+    append(cursor, metadataRecords);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        char* target = buffer.data() + header.dataOffset + records[i].data;
+        auto leaf = dynamic_cast<const Variable*>(nodes[i]);
+        if (leaf) {
+            if (leaf->value().size() > 0)
+                std::memcpy(target, leaf->value().data(), sizeof(float) * size_t(leaf->value().size()));
+        }
+        else if (nodes[i]->op()->arity() < 0) {
+            for (const auto& operand : nodes[i]->operands()) {
+                const uint32_t index = indexOf.at(operand.get());
+                std::memcpy(target, &index, sizeof(index));
+                target += sizeof(index);
+            }
+        }
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(buffer.data(), qint64(buffer.size())) != qint64(buffer.size())) {
+        std::cerr << "serialization::save: can't write " << path.toStdString() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+serialization::NamedExpressions serialization::load(const QString& path, Metadata* metadata)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        std::cerr << "serialization::load: can't open " << path.toStdString() << std::endl;
+        return {};
+    }
+    const uint64_t fileSize = uint64_t(file.size());
+    const uchar* data = fileSize >= sizeof(Header) ? file.map(0, file.size()) : nullptr;
+    Header header;
+    if (data)
+        std::memcpy(&header, data, sizeof(header));
+    if (!data || std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version || header.fileSize != fileSize
+            || header.dataOffset > fileSize
+            || sizeof(Header) + sizeof(NodeRecord) * uint64_t(header.nNodes) + sizeof(RootRecord) * uint64_t(header.nRoots)
+               + sizeof(MetadataRecord) * uint64_t(header.nMetadata) > header.dataOffset) {
+        std::cerr << "serialization::load: " << path.toStdString() << " is not a graph file of version " << version << std::endl;
+        return {};
+    }
+
+    auto corrupt = [&path]() {
+        std::cerr << "serialization::load: " << path.toStdString() << " is corrupt" << std::endl;
+        return NamedExpressions();
+    };
+    // offsets relative to the data section
+    const uint64_t dataSize = fileSize - header.dataOffset;
+    std::vector<ExpressionPtr> nodes;
+    nodes.reserve(header.nNodes);
+    const uchar* cursor = data + sizeof(Header);
+    for (uint32_t i = 0; i < header.nNodes; ++i, cursor += sizeof(NodeRecord)) {
+        NodeRecord record;
+        std::memcpy(&record, cursor, sizeof(record));
+        if (record.kind != KindVariable && record.kind != KindConstant && record.kind != KindOperator)
+            return corrupt();
+        if (record.kind == KindOperator) {
+            const operators::Ptr op = record.opcode < uint8_t(operators::Opcode::Count) ? operators::fromOpcode(operators::Opcode(record.opcode)) : nullptr;
+            std::vector<uint32_t> indices;
+            if (op && op->arity() < 0) {
+                if (record.a > 0 && inFile(record.data, sizeof(uint32_t) * uint64_t(record.a), dataSize)) {
+                    indices.resize(record.a);
+                    std::memcpy(indices.data(), data + header.dataOffset + record.data, sizeof(uint32_t) * indices.size());
+                }
+            }
+            else if (op) {
+                indices = {record.a, record.b};
+                indices.resize(size_t(op->arity()));
+            }
+            std::vector<ExpressionPtr> operands;
+            for (uint32_t index : indices) {
+                if (index < i)
+                    operands.push_back(nodes[index]);
+            }
+            if (operands.empty() || operands.size() != indices.size())
+                return corrupt();
+            nodes.push_back(std::make_shared<Expression>(std::move(operands), op));
+        }
+        else {
+            const uint64_t size = sizeof(float) * uint64_t(record.rows) * uint64_t(record.cols);
+            if (record.rows < 0 || record.cols < 0 || !inFile(record.data, size, dataSize))
+                return corrupt();
+            ArrayXX value(record.rows, record.cols);
+            if (size > 0)
+                std::memcpy(value.data(), data + header.dataOffset + record.data, size_t(size));
+            auto leaf = record.kind == KindConstant ? Constant::make(std::move(value)) : Variable::make(std::move(value));
+            if (record.kind == KindVariable)
+                leaf->setRequiresGradient(record.flags & FlagRequiresGradient);
+            nodes.push_back(leaf);
+        }
+        nodes.back()->setCheckpoint(record.flags & FlagCheckpoint);
+    }
+
+    NamedExpressions roots;
+    for (uint32_t i = 0; i < header.nRoots; ++i, cursor += sizeof(RootRecord)) {
+        RootRecord record;
+        std::memcpy(&record, cursor, sizeof(record));
+        record.name[sizeof(record.name) - 1] = 0;
+        if (record.node >= header.nNodes)
+            return corrupt();
+        roots.emplace_back(record.name, nodes[record.node]);
+    }
+    for (uint32_t i = 0; metadata && i < header.nMetadata; ++i, cursor += sizeof(MetadataRecord)) {
+        MetadataRecord record;
+        std::memcpy(&record, cursor, sizeof(record));
+        record.name[sizeof(record.name) - 1] = 0;
+        metadata->emplace_back(record.name, record.value);
+    }
+    return roots;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019, Adam Celarek | Research Unit of Computer Graphics | TU Wien
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SERIALIZATION_H
+#define SERIALIZATION_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QString>
+
+#include "Expression.h"
+
+// versioned binary format for expression graphs, including the values of all leaves.
+//
+// layout (native byte order): a header, one fixed size record per node (children before parents),
+// one record per named root, one per named scalar of metadata, then the leaf values, column major
+// and each aligned to 64 bytes.
+// variadic operators keep their operand indices in the data section as well.
+// files are memory mapped for loading, only the leaf values are copied out.
+namespace serialization {
+using NamedExpressions = std::vector<std::pair<std::string, ExpressionPtr>>;
+// settings that are not part of the graph, e.g. the learning rate of a net
+using Metadata = std::vector<std::pair<std::string, float>>;
+
+// writes all nodes reachable from the roots. names are at most 59 characters long.
+bool save(const QString& path, const NamedExpressions& roots, const Metadata& metadata = Metadata());
+// the roots in the order they were saved. empty if the file can't be read or has a different version.
+// the metadata goes to metadata, if given.
+NamedExpressions load(const QString& path, Metadata* metadata = nullptr);
+}
+
+#endif // SERIALIZATION_H